@@ -120,6 +120,7 @@ struct idtr {
 //
 //  Control Registers
 //
+#define CR0_WP       (1ul << 16)
 #define CR4_FSGSBASE (1ul << 16)
 #define CR4_OSXSAVE  (1ul << 18)
 
@@ -136,6 +136,9 @@ static void common_setup(void) {
 
     // Activate RDGSBASE/WRGSBASE and XSAVE/XRSTOR instructions.
     asm_write_cr4(asm_read_cr4() | CR4_FSGSBASE | CR4_OSXSAVE);
+    // Make kernel-mode writes to read-only user pages fault as well. Pagers
+    // rely on it to implement copy-on-write.
+    asm_write_cr0(asm_read_cr0() | CR0_WP);
     // Set RDGSBASE to enable the CPUVAR macro.
     struct gsbase *gsbase =
         from_paddr((paddr_t) __cpuvar_base + mp_self() * CPUVAR_SIZE_MAX);
@@ -46,15 +46,17 @@ static error_t sys_ipcctl(userptr_t bulk_ptr, size_t bulk_len, msec_t timeout) {
         CURRENT->bulk_len = bulk_len;
 
         // Resolve page faults in advance. Handling them in the sender context
-        // would be pretty tricky...
+        // would be pretty tricky... We write back a byte in each page instead
+        // of checking if the page is mapped: the sender copies the payload
+        // through the physical address so a copy-on-write page has to be
+        // duplicated here.
         size_t remaining = bulk_len;
         size_t offset = 0;
         while (remaining > 0) {
             userptr_t addr = ALIGN_DOWN(bulk_ptr + offset, PAGE_SIZE);
-            // TODO: Use copy_from_user or copy_to_user instead.
-            if (!vm_resolve(&CURRENT->vm, addr)) {
-                handle_page_fault(addr, PF_USER | PF_WRITE);
-            }
+            uint8_t byte;
+            memcpy_from_user(&byte, addr, sizeof(byte));
+            memcpy_to_user(addr, &byte, sizeof(byte));
 
             remaining -= MIN(remaining, PAGE_SIZE);
             offset += PAGE_SIZE;
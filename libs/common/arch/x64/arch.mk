@@ -19,6 +19,12 @@ QEMUFLAGS += -object filter-dump,id=fiter0,netdev=net0,file=network.pcap
 QEMUFLAGS += $(if $(SMP), -smp $(SMP))
 QEMUFLAGS += $(if $(GUI),,-nographic)
 
+# Attach a disk image as a virtio-blk device.
+ifneq ($(DISK),)
+QEMUFLAGS += -drive if=none,id=disk0,format=raw,file=$(DISK)
+QEMUFLAGS += -device virtio-blk-pci,drive=disk0
+endif
+
 .PHONY: run
 run: $(kernel_image)
 	cp $(kernel_image) $(BUILD_DIR)/resea.qemu.elf
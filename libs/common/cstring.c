@@ -88,3 +88,19 @@ WEAK void memcpy(void *dst, const void *src, size_t len) {
         *d++ = *s++;
     }
 }
+
+WEAK void memmove(void *dst, const void *src, size_t len) {
+    uint8_t *d = dst;
+    const uint8_t *s = src;
+    if (d <= s) {
+        while (len-- > 0) {
+            *d++ = *s++;
+        }
+    } else {
+        d += len;
+        s += len;
+        while (len-- > 0) {
+            *--d = *--s;
+        }
+    }
+}
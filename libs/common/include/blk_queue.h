@@ -0,0 +1,69 @@
+#ifndef __BLK_QUEUE_H__
+#define __BLK_QUEUE_H__
+
+#include <types.h>
+
+//
+//  Asynchronous block I/O queue.
+//
+//  A client allocates physically contiguous pages for a queue: the first page
+//  contains `struct blk_queue` and the rest are data buffers. It grants them to
+//  a block device server (writable) and attaches the queue by
+//  BLK_ATTACH_QUEUE_MSG. Then:
+//
+//    1. The client appends requests into the submission ring and notifies
+//       the server (NOTIFY_NEW_DATA). Many requests can be in flight.
+//    2. The server processes them in any order, writes the data into the
+//       buffers specified by each request, appends a completion with the same
+//       tag into the completion ring, and notifies the client
+//       (NOTIFY_NEW_DATA).
+//
+//  Each ring is a single-producer, single-consumer ring: the producer only
+//  updates `tail` and the consumer only updates `head`.
+//
+
+/// The number of entries in each ring. Must be a power of two.
+#define BLK_QUEUE_DEPTH 32
+/// The maximum number of buffers in a request.
+#define BLK_SG_MAX 8
+
+#define BLK_OP_READ 1
+
+/// A buffer in the data area.
+struct blk_sg {
+    /// The offset from the beginning of the data area.
+    uint32_t offset;
+    /// The length in bytes. Must be a multiple of the sector size.
+    uint32_t len;
+};
+
+struct blk_request {
+    /// An arbitrary value which identifies the request in the completion.
+    uint32_t tag;
+    uint8_t op;
+    uint8_t num_sg;
+    /// The first sector. Buffers are filled in order from it.
+    offset_t sector;
+    struct blk_sg sg[BLK_SG_MAX];
+};
+
+struct blk_completion {
+    uint32_t tag;
+    /// OK or an error code.
+    error_t status;
+};
+
+struct blk_queue {
+    /// The submission ring (produced by the client).
+    uint32_t sq_head;
+    uint32_t sq_tail;
+    struct blk_request sq[BLK_QUEUE_DEPTH];
+    /// The completion ring (produced by the server).
+    uint32_t cq_head;
+    uint32_t cq_tail;
+    struct blk_completion cq[BLK_QUEUE_DEPTH];
+};
+
+STATIC_ASSERT(sizeof(struct blk_queue) <= PAGE_SIZE);
+
+#endif
@@ -11,5 +11,6 @@ char *strstr(const char *haystack, const char *needle);
 int memcmp(const void *p1, const void *p2, size_t len);
 void memset(void *dst, int ch, size_t len);
 void memcpy(void *dst, const void *src, size_t len);
+void memmove(void *dst, const void *src, size_t len);
 
 #endif
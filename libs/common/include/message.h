@@ -35,6 +35,45 @@ typedef uint16_t keycode_t;
 #define KEY_MOD_CTRL (1 << 8)
 #define KEY_MOD_ALT  (1 << 9)
 
+//
+//  File System Server
+//
+
+#define FS_ATTR_READ_ONLY 0x01
+#define FS_ATTR_HIDDEN    0x02
+#define FS_ATTR_SYSTEM    0x04
+#define FS_ATTR_DIRECTORY 0x10
+#define FS_ATTR_ARCHIVE   0x20
+
+/// A directory entry in FS_READDIR_REPLY_MSG.
+struct fs_dirent {
+    /// The file name (e.g. "HELLO.TXT"). Null-terminated.
+    char name[13];
+    /// FS_ATTR_*.
+    uint8_t attr;
+    uint16_t reserved;
+    uint32_t size;
+    /// The first cluster of the file. 0 if no clusters are allocated.
+    uint32_t cluster;
+} PACKED;
+
+//
+//  TCP/IP Server
+//
+
+/// Options in TCPIP_SET_OPTION_MSG.
+#define TCPIP_OPT_CONGESTION_CONTROL 1
+/// The size of the receive buffer in bytes. It disables the autotuning.
+#define TCPIP_OPT_RCVBUF 2
+/// The size of the send buffer in bytes. Once it's set, TCPIP_WRITE_MSG fails
+/// with ERR_WOULD_BLOCK if the data does not fit in it. The send buffer is
+/// unlimited by default.
+#define TCPIP_OPT_SNDBUF 3
+
+/// Congestion control algorithms (TCPIP_OPT_CONGESTION_CONTROL).
+#define TCPIP_CC_NEWRENO 0
+#define TCPIP_CC_CUBIC   1
+
 #define ID(x)  (x)
 #define _NTH_MEMBER(member) \
     ({ \
@@ -123,6 +162,37 @@ struct message {
         struct {
         } join_reply;
 
+        #define GRANT_PAGES_MSG ID(17)
+        struct {
+            task_t task;
+            vaddr_t vaddr;
+            size_t num_pages;
+            /// Only pages allocated by ALLOC_PAGES_MSG can be granted as
+            /// writable.
+            bool writable;
+        } grant_pages;
+
+        #define GRANT_PAGES_REPLY_MSG ID(18)
+        struct {
+            vaddr_t vaddr;
+        } grant_pages_reply;
+
+        /// Checks that the pages at `vaddr` in the sender are granted by
+        /// `task` (GRANT_PAGES_MSG). Servers use it to validate buffers
+        /// passed by clients before accessing them.
+        #define VERIFY_GRANT_MSG ID(19)
+        struct {
+            task_t task;
+            vaddr_t vaddr;
+            size_t num_pages;
+            /// Whether the pages must be granted as writable.
+            bool writable;
+        } verify_grant;
+
+        #define VERIFY_GRANT_REPLY_MSG ID(20)
+        struct {
+        } verify_grant_reply;
+
         #define FS_OPEN_MSG (ID(50) | BULK(fs_open.path, fs_open.len))
         struct {
             char *path;
@@ -156,6 +226,103 @@ struct message {
             size_t len;
         } fs_read_reply;
 
+        /// Writes data into the file. Data is written back to the disk later:
+        /// use FS_SYNC_MSG to ensure it's on the disk.
+        #define FS_WRITE_MSG (ID(56) | BULK(fs_write.data, fs_write.len))
+        struct {
+            handle_t handle;
+            offset_t offset;
+            void *data;
+            size_t len;
+        } fs_write;
+
+        #define FS_WRITE_REPLY_MSG ID(57)
+        struct {
+        } fs_write_reply;
+
+        #define FS_SYNC_MSG ID(58)
+        struct {
+        } fs_sync;
+
+        #define FS_SYNC_REPLY_MSG ID(59)
+        struct {
+        } fs_sync_reply;
+
+        /// Creates an empty file.
+        #define FS_CREATE_MSG (ID(60) | BULK(fs_create.path, fs_create.len))
+        struct {
+            char *path;
+            size_t len;
+        } fs_create;
+
+        #define FS_CREATE_REPLY_MSG ID(61)
+        struct {
+        } fs_create_reply;
+
+        /// Lists entries in the directory from `cookie` (0 to start from the
+        /// beginning). The reply contains as many entries as the bulk buffer
+        /// allows: pass `next_cookie` to get the next ones. Returns
+        /// ERR_END if there are no more entries.
+        #define FS_READDIR_MSG (ID(62) | BULK(fs_readdir.path, fs_readdir.len))
+        struct {
+            char *path;
+            size_t len;
+            offset_t cookie;
+        } fs_readdir;
+
+        #define FS_READDIR_REPLY_MSG (ID(63) | BULK(fs_readdir_reply.entries, fs_readdir_reply.len))
+        struct {
+            struct fs_dirent *entries;
+            /// The size of `entries` in bytes.
+            size_t len;
+            offset_t next_cookie;
+            /// True if the reply contains the last entry.
+            bool end;
+        } fs_readdir_reply;
+
+        /// Registers pages shared by GRANT_PAGES_MSG (writable) as the
+        /// client's buffer for FS_READ_BUFFER_MSG. `vaddr` is the address in
+        /// the file system server. It replaces the previous one.
+        #define FS_ATTACH_BUFFER_MSG ID(64)
+        struct {
+            vaddr_t vaddr;
+            size_t num_pages;
+        } fs_attach_buffer;
+
+        #define FS_ATTACH_BUFFER_REPLY_MSG ID(65)
+        struct {
+        } fs_attach_buffer_reply;
+
+        /// Reads the file into the buffer attached by FS_ATTACH_BUFFER_MSG at
+        /// `buffer_offset`. Unlike FS_READ_MSG, the length is limited only by
+        /// the size of the buffer.
+        #define FS_READ_BUFFER_MSG ID(66)
+        struct {
+            handle_t handle;
+            offset_t offset;
+            size_t len;
+            size_t buffer_offset;
+        } fs_read_buffer;
+
+        /// `len` is shorter than the requested length at the end of file.
+        #define FS_READ_BUFFER_REPLY_MSG ID(67)
+        struct {
+            size_t len;
+        } fs_read_buffer_reply;
+
+        #define FS_STAT_MSG ID(68)
+        struct {
+            handle_t handle;
+        } fs_stat;
+
+        /// `version` changes whenever the file is written. It's 0 if the file
+        /// has not been written since the server started.
+        #define FS_STAT_REPLY_MSG ID(69)
+        struct {
+            size_t size;
+            uint32_t version;
+        } fs_stat_reply;
+
         #define TCPIP_REGISTER_DEVICE_MSG ID(70)
         struct {
             uint8_t macaddr[6];
@@ -223,6 +390,15 @@ struct message {
             handle_t handle;
         } tcpip_received;
 
+        /// Sets a socket option (TCPIP_OPT_*). Sockets accepted from a
+        /// listening socket inherit its options.
+        #define TCPIP_SET_OPTION_MSG ID(84)
+        struct {
+            handle_t handle;
+            int option;
+            int value;
+        } tcpip_set_option;
+
         // FIXME:
         #define NET_GET_TX_MSG ID(100)
         #define NET_TX_MSG (ID(101) | BULK(net_tx.payload, net_tx.len))
@@ -249,6 +425,39 @@ struct message {
             size_t len;
         } blk_read_reply;
 
+        #define BLK_MAP_MSG ID(122)
+        struct {
+        } blk_map;
+
+        #define BLK_MAP_REPLY_MSG ID(123)
+        struct {
+            vaddr_t vaddr;
+            size_t num_sectors;
+        } blk_map_reply;
+
+        /// Attaches an asynchronous I/O queue (see blk_queue.h). The pages
+        /// must be granted to the server as writable.
+        #define BLK_ATTACH_QUEUE_MSG ID(124)
+        struct {
+            vaddr_t vaddr;
+            size_t num_pages;
+        } blk_attach_queue;
+
+        #define BLK_ATTACH_QUEUE_REPLY_MSG ID(125)
+        struct {
+        } blk_attach_queue_reply;
+
+        #define BLK_WRITE_MSG (ID(126) | BULK(blk_write.data, blk_write.len))
+        struct {
+            offset_t sector;
+            uint8_t *data;
+            size_t len;
+        } blk_write;
+
+        #define BLK_WRITE_REPLY_MSG ID(127)
+        struct {
+        } blk_write_reply;
+
         // FIXME:
         #define KBD_GET_KEYCODE_MSG ID(110)
         #define KBD_KEYCODE_MSG ID(110)
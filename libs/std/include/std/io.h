@@ -4,6 +4,16 @@
 #include <arch/io.h>
 #include <types.h>
 
+/// The maximum number of pages requested from init at once to refill the page
+/// pool.
+#define IO_PAGE_POOL_CHUNK 32
+/// `io_refill_page_pool` refills the page pool if it has fewer pages.
+#define IO_PAGE_POOL_LOW 8
+
 void *io_alloc_pages(size_t num_pages, paddr_t map_to, paddr_t *paddr);
+void io_free_page(void *ptr, paddr_t paddr);
+void io_refill_page_pool(void);
+error_t io_verify_grant(task_t owner, vaddr_t vaddr, size_t num_pages,
+                        bool writable);
 
 #endif
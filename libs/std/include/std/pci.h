@@ -1,5 +1,5 @@
-#ifndef __PCI_H__
-#define __PCI_H__
+#ifndef __STD_PCI_H__
+#define __STD_PCI_H__
 
 #include <types.h>
 
@@ -0,0 +1,38 @@
+#ifndef __STD_REGIONS_H__
+#define __STD_REGIONS_H__
+
+#include <types.h>
+
+/// The members common to all region types: a virtual memory region
+/// `[start, end)`. A region type stored in a region map must begin with them,
+/// followed by its own members:
+///
+///     struct region {
+///         REGION_FIELDS
+///         enum region_type type;
+///     };
+///
+#define REGION_FIELDS                                                          \
+    vaddr_t start;                                                             \
+    vaddr_t end;
+
+struct region_header {
+    REGION_FIELDS
+};
+
+/// Non-overlapping virtual memory regions sorted by the address. Each region
+/// is `region_size` bytes long.
+struct region_map {
+    void *regions;
+    size_t region_size;
+    size_t num_regions;
+    size_t capacity;
+};
+
+void regions_init(struct region_map *map, size_t region_size);
+void regions_free(struct region_map *map);
+void regions_add(struct region_map *map, const void *region);
+void *regions_lookup(struct region_map *map, vaddr_t vaddr);
+void *regions_next(struct region_map *map, const void *region);
+
+#endif
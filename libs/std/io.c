@@ -4,7 +4,21 @@
 #include <std/printf.h>
 #include <std/syscall.h>
 
-void *io_alloc_pages(size_t num_pages, paddr_t map_to, paddr_t *paddr) {
+/// A free page in the page pool. The header is stored in the page itself.
+struct free_page {
+    struct free_page *next;
+    paddr_t paddr;
+};
+
+/// Pages allocated from init in advance (or freed by `io_free_page`).
+static struct free_page *page_pool = NULL;
+static size_t page_pool_len = 0;
+/// The number of pages to request when the page pool runs out. It starts from
+/// a single page and doubles up to IO_PAGE_POOL_CHUNK so that tasks which
+/// allocate only a few pages don't pin a whole chunk.
+static size_t page_pool_refill_len = 1;
+
+static void *alloc_pages(size_t num_pages, paddr_t map_to, paddr_t *paddr) {
     task_t init = 1;
 
     // Request alloc_pages.
@@ -19,3 +33,63 @@ void *io_alloc_pages(size_t num_pages, paddr_t map_to, paddr_t *paddr) {
     *paddr = m.alloc_pages_reply.paddr;
     return (void *) m.alloc_pages_reply.vaddr;
 }
+
+/// Fills the page pool with `num_pages` pages allocated at once.
+static void refill_page_pool(size_t num_pages) {
+    paddr_t paddr;
+    uint8_t *ptr = alloc_pages(num_pages, 0, &paddr);
+    for (size_t i = 0; i < num_pages; i++) {
+        io_free_page(&ptr[i * PAGE_SIZE], paddr + i * PAGE_SIZE);
+    }
+}
+
+/// Allocates physically contiguous pages. A single page not mapped to
+/// `map_to` is taken from the page pool to avoid a round trip to init.
+void *io_alloc_pages(size_t num_pages, paddr_t map_to, paddr_t *paddr) {
+    if (num_pages != 1 || map_to) {
+        return alloc_pages(num_pages, map_to, paddr);
+    }
+
+    if (!page_pool) {
+        refill_page_pool(page_pool_refill_len);
+        page_pool_refill_len =
+            MIN(page_pool_refill_len * 2, IO_PAGE_POOL_CHUNK);
+    }
+
+    struct free_page *page = page_pool;
+    page_pool = page->next;
+    page_pool_len--;
+    *paddr = page->paddr;
+    return page;
+}
+
+/// Returns a page allocated by `io_alloc_pages` to the page pool. Since we
+/// can't unmap pages, it's kept in the pool instead of being returned to init.
+void io_free_page(void *ptr, paddr_t paddr) {
+    struct free_page *page = ptr;
+    page->paddr = paddr;
+    page->next = page_pool;
+    page_pool = page;
+    page_pool_len++;
+}
+
+/// Fills the page pool up to the low watermark. Call this when the task is
+/// idle to keep `io_alloc_pages` off the slow path.
+void io_refill_page_pool(void) {
+    if (page_pool_len < IO_PAGE_POOL_LOW) {
+        refill_page_pool(IO_PAGE_POOL_CHUNK);
+    }
+}
+
+/// Checks that the pages at `vaddr` are granted by `owner` (GRANT_PAGES_MSG).
+/// Use it before accessing a buffer passed by a client.
+error_t io_verify_grant(task_t owner, vaddr_t vaddr, size_t num_pages,
+                        bool writable) {
+    struct message m;
+    m.type = VERIFY_GRANT_MSG;
+    m.verify_grant.task = owner;
+    m.verify_grant.vaddr = vaddr;
+    m.verify_grant.num_pages = num_pages;
+    m.verify_grant.writable = writable;
+    return ipc_call(INIT_TASK_TID, &m);
+}
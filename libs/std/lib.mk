@@ -1,2 +1,2 @@
-objs := init.o syscall.o printf.o malloc.o io.o lookup.o string.o map.o rand.o
+objs := init.o syscall.o printf.o malloc.o io.o lookup.o string.o map.o rand.o regions.o pci.o
 include libs/std/arch/$(ARCH)/arch.mk
@@ -1,6 +1,6 @@
 #include <std/io.h>
 #include <std/printf.h>
-#include "pci.h"
+#include <std/pci.h>
 
 static uint32_t read32(uint8_t bus, uint8_t slot, uint16_t offset) {
     ASSERT(IS_ALIGNED(offset, 4));
@@ -41,7 +41,7 @@ bool pci_find_device(struct pci_device *dev, uint16_t vendor, uint16_t device) {
                 continue;
             }
 
-            if (device2 != PCI_ANY && device2 != device) {
+            if (device != PCI_ANY && device != device2) {
                 continue;
             }
 
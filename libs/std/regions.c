@@ -0,0 +1,101 @@
+#include <std/malloc.h>
+#include <std/printf.h>
+#include <std/regions.h>
+#include <cstring.h>
+
+#define REGIONS_INITIAL_CAPACITY 8
+
+static struct region_header *get(struct region_map *map, size_t index) {
+    return (struct region_header *) ((uint8_t *) map->regions
+                                     + index * map->region_size);
+}
+
+/// Returns the index of the first region which ends after `vaddr`. Since the
+/// regions don't overlap, ends are sorted as well as starts.
+static size_t find_index(struct region_map *map, vaddr_t vaddr) {
+    size_t lo = 0;
+    size_t hi = map->num_regions;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (get(map, mid)->end <= vaddr) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return lo;
+}
+
+static void insert(struct region_map *map, size_t index, const void *region,
+                   vaddr_t start, vaddr_t end) {
+    if (map->num_regions == map->capacity) {
+        size_t new_capacity = map->capacity * 2;
+        void *new_regions = malloc(map->region_size * new_capacity);
+        memcpy(new_regions, map->regions, map->region_size * map->num_regions);
+        free(map->regions);
+        map->regions = new_regions;
+        map->capacity = new_capacity;
+    }
+
+    memmove(get(map, index + 1), get(map, index),
+            map->region_size * (map->num_regions - index));
+    struct region_header *r = get(map, index);
+    memcpy(r, region, map->region_size);
+    r->start = start;
+    r->end = end;
+    map->num_regions++;
+}
+
+/// Initializes an empty map. `region_size` is the size of the region type,
+/// which begins with REGION_FIELDS.
+void regions_init(struct region_map *map, size_t region_size) {
+    DEBUG_ASSERT(region_size >= sizeof(struct region_header));
+    map->regions = malloc(region_size * REGIONS_INITIAL_CAPACITY);
+    map->region_size = region_size;
+    map->num_regions = 0;
+    map->capacity = REGIONS_INITIAL_CAPACITY;
+}
+
+void regions_free(struct region_map *map) {
+    free(map->regions);
+    map->regions = NULL;
+    map->num_regions = 0;
+    map->capacity = 0;
+}
+
+/// Adds a copy of the region. Parts overlapping existing regions are ignored,
+/// that is, regions added earlier take precedence.
+void regions_add(struct region_map *map, const void *region) {
+    const struct region_header *new = region;
+    vaddr_t start = new->start;
+    size_t i = find_index(map, start);
+    while (start < new->end) {
+        if (i == map->num_regions || new->end <= get(map, i)->start) {
+            insert(map, i, region, start, new->end);
+            return;
+        }
+
+        if (start < get(map, i)->start) {
+            insert(map, i, region, start, get(map, i)->start);
+            i++;
+        }
+
+        start = get(map, i)->end;
+        i++;
+    }
+}
+
+/// Returns the first region which ends after `vaddr`. Note that the region
+/// may start after `vaddr`. Returns NULL if there's no such region.
+void *regions_lookup(struct region_map *map, vaddr_t vaddr) {
+    size_t i = find_index(map, vaddr);
+    return (i < map->num_regions) ? get(map, i) : NULL;
+}
+
+/// Returns the region next to `region` or NULL if it's the last one.
+void *regions_next(struct region_map *map, const void *region) {
+    const uint8_t *next = (const uint8_t *) region + map->region_size;
+    return (next < (uint8_t *) get(map, map->num_regions)) ? (void *) next
+                                                            : NULL;
+}
@@ -31,4 +31,12 @@ struct elf64_phdr {
     uint64_t p_align;
 } PACKED;
 
+// Segment types (p_type).
+#define PT_LOAD 1
+
+// Segment permissions (p_flags).
+#define PF_X (1 << 0)
+#define PF_W (1 << 1)
+#define PF_R (1 << 2)
+
 #endif
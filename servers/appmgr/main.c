@@ -2,13 +2,12 @@
 #include <message.h>
 #include <std/malloc.h>
 #include <std/printf.h>
+#include <std/regions.h>
 #include <std/syscall.h>
-#include <std/lookup.h>
+#include <std/io.h>
 #include <cstring.h>
 #include "elf.h"
 
-static task_t init_server;
-
 extern char __zeroed_pages[];
 extern char __free_vaddr[];
 extern char __free_vaddr_end[];
@@ -16,6 +15,68 @@ extern char __free_vaddr_end[];
 /// The maximum size of bss + stack + heap.
 #define ZEROED_PAGES_SIZE (64 * 1024 * 1024)
 #define TID_BASE 16 // FIXME:
+/// The maximum number of pre-zeroed pages.
+#define ZEROED_POOL_MAX 32
+/// The interval and the number of pages to refill the pre-zeroed pages pool.
+#define ZEROED_POOL_REFILL_INTERVAL 10
+#define ZEROED_POOL_REFILL_BATCH    8
+/// The initial and the maximum numbers of pages read ahead on sequential
+/// page faults.
+#define READAHEAD_MIN_PAGES 2
+#define READAHEAD_MAX_PAGES 32
+/// The number of pages in the buffer shared with the file system server. File
+/// data is read into it by FS_READ_BUFFER_MSG.
+#define READ_BUFFER_PAGES READAHEAD_MAX_PAGES
+
+/// A page allocated from the page pool. Pages of exited tasks are returned to
+/// the pool.
+struct page {
+    list_elem_t next;
+    /// The address where the page is mapped in appmgr.
+    void *ptr;
+    paddr_t paddr;
+};
+
+/// A page in the image cache.
+struct cached_page {
+    /// The address where the page is mapped in appmgr. NULL if it's not yet
+    /// filled.
+    void *ptr;
+    paddr_t paddr;
+};
+
+/// Pages filled with the contents of an executable file. Tasks launched from
+/// the same file share them instead of having their own copies.
+struct image {
+    list_elem_t next;
+    char name[16];
+    task_t fs_server;
+    /// The version of the file (FS_STAT_MSG) the pages are filled from.
+    uint32_t version;
+    /// The number of tasks launched from the image.
+    unsigned ref_count;
+    /// True if the file has been changed since. The image is no longer in
+    /// `images` and is freed once no tasks use it.
+    bool stale;
+    /// Indexed by the page offset in the file.
+    struct cached_page *pages;
+    size_t num_pages;
+};
+
+enum region_type {
+    /// A loadable ELF segment.
+    REGION_SEGMENT,
+    /// Zero-filled pages (.bss section, stack, and heap).
+    REGION_ZEROED,
+};
+
+/// A virtual memory region `[start, end)` of a task.
+struct region {
+    REGION_FIELDS
+    enum region_type type;
+    /// The program header (REGION_SEGMENT).
+    struct elf64_phdr *phdr;
+};
 
 /// Task Control Block (TCB).
 struct task {
@@ -24,14 +85,37 @@ struct task {
     char name[32];
     task_t fs_server;
     handle_t handle;
+    struct image *image;
     void *file_header;
     struct elf64_ehdr *ehdr;
     struct elf64_phdr *phdrs;
+    /// ELF segments and the zeroed pages.
+    struct region_map regions;
+    /// The file offset of the next page if the task accesses the file
+    /// sequentially.
+    offset_t next_fault_offset;
+    /// The number of pages to read ahead on the next cache miss. It grows
+    /// while the task keeps faulting sequentially.
+    size_t readahead_pages;
     bool exited;
     task_t waiter;
+    /// Pages allocated for the task (struct page).
+    list_t pages;
 };
 
 static struct task tasks[TASKS_MAX];
+static list_t images;
+/// Pre-zeroed pages (struct page).
+static list_t zeroed_pool;
+static size_t zeroed_pool_len = 0;
+/// The zero-filled page shared by all tasks. It's never freed.
+static paddr_t zero_page;
+/// Whether the timer to refill the pre-zeroed pages pool is set.
+static bool refill_timer_set = false;
+/// The buffer shared with the file system server.
+static uint8_t *read_buffer = NULL;
+/// The file system server which `read_buffer` is attached to.
+static task_t read_buffer_server = 0;
 
 /// Look for the task in the our task table.
 static struct task *get_task_by_tid(task_t tid) {
@@ -44,25 +128,134 @@ static struct task *get_task_by_tid(task_t tid) {
     return task;
 }
 
-static error_t read_file(task_t fs_server, handle_t handle, offset_t off,
-                         void *buf, size_t len) {
+/// Shares `read_buffer` with the file system server.
+static error_t attach_read_buffer(task_t fs_server) {
+    if (!read_buffer) {
+        paddr_t paddr;
+        read_buffer = io_alloc_pages(READ_BUFFER_PAGES, 0, &paddr);
+    }
+
+    struct message m;
+    m.type = GRANT_PAGES_MSG;
+    m.grant_pages.task = fs_server;
+    m.grant_pages.vaddr = (vaddr_t) read_buffer;
+    m.grant_pages.num_pages = READ_BUFFER_PAGES;
+    m.grant_pages.writable = true;
+    error_t err = ipc_call(INIT_TASK_TID, &m);
+    if (IS_ERROR(err)) {
+        return err;
+    }
+
+    ASSERT(m.type == GRANT_PAGES_REPLY_MSG);
+    vaddr_t server_vaddr = m.grant_pages_reply.vaddr;
+    m.type = FS_ATTACH_BUFFER_MSG;
+    m.fs_attach_buffer.vaddr = server_vaddr;
+    m.fs_attach_buffer.num_pages = READ_BUFFER_PAGES;
+    err = ipc_call(fs_server, &m);
+    if (IS_ERROR(err)) {
+        return err;
+    }
+
+    read_buffer_server = fs_server;
+    return OK;
+}
+
+/// Reads the file into `read_buffer`. `*read_len` is shorter than `len` at the
+/// end of file.
+static error_t read_into_buffer(task_t fs_server, handle_t handle, offset_t off,
+                                size_t len, size_t *read_len) {
+    DEBUG_ASSERT(len <= READ_BUFFER_PAGES * PAGE_SIZE);
+    if (read_buffer_server != fs_server) {
+        error_t err = attach_read_buffer(fs_server);
+        if (IS_ERROR(err)) {
+            return err;
+        }
+    }
+
     struct message m;
-    m.type = FS_READ_MSG;
-    m.fs_read.handle = handle;
-    m.fs_read.offset = off;
-    m.fs_read.len = len;
+    m.type = FS_READ_BUFFER_MSG;
+    m.fs_read_buffer.handle = handle;
+    m.fs_read_buffer.offset = off;
+    m.fs_read_buffer.len = len;
+    m.fs_read_buffer.buffer_offset = 0;
     error_t err = ipc_call(fs_server, &m);
     if (IS_ERROR(err)) {
         return err;
     }
 
-    ASSERT(m.type == FS_READ_REPLY_MSG);
-    ASSERT(len == m.fs_read_reply.len);
-    memcpy(buf, m.fs_read_reply.data, m.fs_read_reply.len);
-    free(m.fs_read_reply.data);
+    ASSERT(m.type == FS_READ_BUFFER_REPLY_MSG);
+    ASSERT(m.fs_read_buffer_reply.len <= len);
+    *read_len = m.fs_read_buffer_reply.len;
     return OK;
 }
 
+static error_t read_file(task_t fs_server, handle_t handle, offset_t off,
+                         void *buf, size_t len) {
+    size_t read_len;
+    error_t err = read_into_buffer(fs_server, handle, off, len, &read_len);
+    if (IS_ERROR(err)) {
+        return err;
+    }
+
+    memcpy(buf, read_buffer, read_len);
+    memset((uint8_t *) buf + read_len, 0, len - read_len);
+    return OK;
+}
+
+static void free_image(struct image *image) {
+    for (size_t i = 0; i < image->num_pages; i++) {
+        if (image->pages[i].ptr) {
+            io_free_page(image->pages[i].ptr, image->pages[i].paddr);
+        }
+    }
+
+    free(image->pages);
+    free(image);
+}
+
+/// Looks for the image cache of the executable. It creates a new one if it
+/// does not exist or the file has been changed.
+static struct image *get_image(const char *name, task_t fs_server,
+                               uint32_t version, struct elf64_ehdr *ehdr,
+                               struct elf64_phdr *phdrs) {
+    LIST_FOR_EACH (image, &images, struct image, next) {
+        if (image->fs_server == fs_server
+            && !strncmp(image->name, name, sizeof(image->name))) {
+            if (image->version == version) {
+                image->ref_count++;
+                return image;
+            }
+
+            // The file has been rewritten: don't launch new tasks from the
+            // old contents.
+            list_remove(&image->next);
+            image->stale = true;
+            if (!image->ref_count) {
+                free_image(image);
+            }
+            break;
+        }
+    }
+
+    // Determine the file size from the program headers.
+    offset_t file_size = 0;
+    for (unsigned i = 0; i < ehdr->e_phnum; i++) {
+        file_size = MAX(file_size, phdrs[i].p_offset + phdrs[i].p_filesz);
+    }
+
+    struct image *image = malloc(sizeof(*image));
+    strncpy(image->name, name, sizeof(image->name));
+    image->fs_server = fs_server;
+    image->version = version;
+    image->ref_count = 1;
+    image->stale = false;
+    image->num_pages = ALIGN_UP(file_size, PAGE_SIZE) / PAGE_SIZE;
+    image->pages = malloc(sizeof(struct cached_page) * image->num_pages);
+    memset(image->pages, 0, sizeof(struct cached_page) * image->num_pages);
+    list_push_back(&images, &image->next);
+    return image;
+}
+
 static task_t exec(const char *name, task_t fs_server, handle_t handle) {
     TRACE("launching %s...", name);
 
@@ -89,9 +282,20 @@ static task_t exec(const char *name, task_t fs_server, handle_t handle) {
         return ERR_NOT_ACCEPTABLE;
     }
 
+    // The cached image is reused only if the file is not changed.
+    struct message m;
+    m.type = FS_STAT_MSG;
+    m.fs_stat.handle = handle;
+    error_t err = ipc_call(fs_server, &m);
+    if (IS_ERROR(err)) {
+        free(file_header);
+        return err;
+    }
+
+    ASSERT(m.type == FS_STAT_REPLY_MSG);
+
     // Create a new task for the server.
-    error_t err =
-        task_create(task->tid, name, ehdr->e_entry, task_self(), CAP_ALL);
+    err = task_create(task->tid, name, ehdr->e_entry, task_self(), CAP_ALL);
     ASSERT_OK(err);
 
     task->in_use = true;
@@ -100,82 +304,284 @@ static task_t exec(const char *name, task_t fs_server, handle_t handle) {
     task->file_header = file_header;
     task->ehdr = ehdr;
     task->phdrs = (struct elf64_phdr *) ((uintptr_t) ehdr + ehdr->e_ehsize);
+    task->image = get_image(name, fs_server, m.fs_stat_reply.version,
+                            task->ehdr, task->phdrs);
+    task->next_fault_offset = 0;
+    task->readahead_pages = 0;
     task->exited = false;
     task->waiter = 0;
+    list_init(&task->pages);
     strncpy(task->name, name, sizeof(task->name));
 
+    regions_init(&task->regions, sizeof(struct region));
+    struct region zeroed;
+    zeroed.start = (vaddr_t) __zeroed_pages;
+    zeroed.end = zeroed.start + ZEROED_PAGES_SIZE;
+    zeroed.type = REGION_ZEROED;
+    regions_add(&task->regions, &zeroed);
+    for (unsigned i = 0; i < ehdr->e_phnum; i++) {
+        struct elf64_phdr *phdr = &task->phdrs[i];
+        if (phdr->p_type != PT_LOAD || !phdr->p_memsz) {
+            continue;
+        }
+
+        struct region segment;
+        segment.start = phdr->p_vaddr;
+        segment.end = phdr->p_vaddr + phdr->p_memsz;
+        segment.type = REGION_SEGMENT;
+        segment.phdr = phdr;
+        regions_add(&task->regions, &segment);
+    }
+
     return task->tid;
 }
 
-static void *alloc_page(paddr_t *paddr) {
-    struct message m;
-    m.type = ALLOC_PAGES_MSG;
-    m.alloc_pages.num_pages = 1;
-    m.alloc_pages.paddr = 0;
-    error_t err = ipc_call(init_server, &m);
-    ASSERT_OK(err);
-    *paddr = m.alloc_pages_reply.paddr;
-    return (void *) m.alloc_pages_reply.vaddr;
+/// Takes a page from the page pool in libs/std.
+static struct page *take_page(void) {
+    struct page *page = malloc(sizeof(*page));
+    page->ptr = io_alloc_pages(1, 0, &page->paddr);
+    return page;
 }
 
-static paddr_t pager(struct task *task, vaddr_t vaddr, pagefault_t fault) {
-    if (fault & PF_PRESENT) {
-        // Invalid access. For instance the user thread has tried to write to
-        // readonly area.
-        WARN("%s: invalid memory access at %p (perhaps segfault?)", task->name,
-             vaddr);
-        return 0;
+/// Allocates a page. If `task` is not NULL, the page is owned by the task and
+/// will be reused once the task exits.
+static void *alloc_page(struct task *task, paddr_t *paddr) {
+    if (!task) {
+        return io_alloc_pages(1, 0, paddr);
     }
 
-    // Zeroed pages.
-    vaddr_t zeroed_pages_start = (vaddr_t) __zeroed_pages;
-    vaddr_t zeroed_pages_end = zeroed_pages_start + ZEROED_PAGES_SIZE;
-    if (zeroed_pages_start <= vaddr && vaddr < zeroed_pages_end) {
-        // The accessed page is zeroed one (.bss section, stack, or heap).
-        paddr_t paddr;
-        void *p = alloc_page(&paddr);
+    struct page *page = take_page();
+    list_push_back(&task->pages, &page->next);
+    *paddr = page->paddr;
+    return page->ptr;
+}
+
+/// Allocates a zero-filled page owned by the task. It takes one from the pool
+/// of pre-zeroed pages or zeroes a new page if the pool is empty.
+static void *alloc_zeroed_page(struct task *task, paddr_t *paddr) {
+    struct page *page = LIST_POP_FRONT(&zeroed_pool, struct page, next);
+    if (!page) {
+        void *p = alloc_page(task, paddr);
         memset(p, 0, PAGE_SIZE);
-        return paddr;
+        return p;
     }
 
-    // Look for the associated program header.
-    struct elf64_phdr *phdr = NULL;
-    for (unsigned i = 0; i < task->ehdr->e_phnum; i++) {
-        // Ignore GNU_STACK
-        if (!task->phdrs[i].p_vaddr) {
+    zeroed_pool_len--;
+    list_push_back(&task->pages, &page->next);
+    *paddr = page->paddr;
+    return page->ptr;
+}
+
+/// Zeroes at most `max_pages` pages into the pool.
+static void refill_zeroed_pool(size_t max_pages) {
+    while (max_pages-- > 0 && zeroed_pool_len < ZEROED_POOL_MAX) {
+        struct page *page = take_page();
+        memset(page->ptr, 0, PAGE_SIZE);
+        list_push_back(&zeroed_pool, &page->next);
+        zeroed_pool_len++;
+    }
+}
+
+/// Sets the timer to refill the pre-zeroed pages pool later if needed.
+static void schedule_zeroed_pool_refill(void) {
+    if (!refill_timer_set && zeroed_pool_len < ZEROED_POOL_MAX) {
+        error_t err = timer_set(ZEROED_POOL_REFILL_INTERVAL);
+        ASSERT_OK(err);
+        refill_timer_set = true;
+    }
+}
+
+/// Fills the image cache pages from `index` to `index + num_pages - 1` which
+/// are not yet filled. Consecutive pages are read by a single
+/// FS_READ_BUFFER_MSG.
+static error_t fill_cached_pages(struct task *task, size_t index,
+                                 size_t num_pages) {
+    struct image *image = task->image;
+    size_t end = MIN(index + num_pages, image->num_pages);
+    while (index < end) {
+        if (image->pages[index].ptr) {
+            index++;
             continue;
         }
 
-        vaddr_t start = task->phdrs[i].p_vaddr;
-        vaddr_t end = start + task->phdrs[i].p_memsz;
-        if (start <= vaddr && vaddr <= end) {
-            phdr = &task->phdrs[i];
-            break;
+        size_t n = 1;
+        while (index + n < end && n < READ_BUFFER_PAGES
+               && !image->pages[index + n].ptr) {
+            n++;
+        }
+
+        size_t len;
+        error_t err = read_into_buffer(task->fs_server, task->handle,
+                                       index * PAGE_SIZE, n * PAGE_SIZE, &len);
+        if (IS_ERROR(err)) {
+            return err;
         }
+
+        for (size_t i = 0; i < n; i++) {
+            struct cached_page *page = &image->pages[index + i];
+            size_t off = i * PAGE_SIZE;
+            size_t copy_len = (off < len) ? MIN(PAGE_SIZE, len - off) : 0;
+            page->ptr = alloc_page(NULL, &page->paddr);
+            memcpy(page->ptr, &read_buffer[off], copy_len);
+            memset((uint8_t *) page->ptr + copy_len, 0, PAGE_SIZE - copy_len);
+        }
+
+        index += n;
     }
 
-    if (!phdr) {
-        WARN("invalid memory access (addr=%p), killing %s...", vaddr, task->name);
+    return OK;
+}
+
+/// Returns a page filled with the file contents at `offset`. The page is
+/// shared among tasks: map it as read-only.
+static struct cached_page *get_cached_page(struct task *task, offset_t offset) {
+    struct cached_page *page = &task->image->pages[offset / PAGE_SIZE];
+    if (!page->ptr) {
+        // Read the following pages together if the task is walking through
+        // the file sequentially.
+        if (offset == task->next_fault_offset) {
+            task->readahead_pages =
+                MIN(MAX(task->readahead_pages * 2, READAHEAD_MIN_PAGES),
+                    READAHEAD_MAX_PAGES);
+        } else {
+            task->readahead_pages = 0;
+        }
+
+        error_t err = fill_cached_pages(task, offset / PAGE_SIZE,
+                                        1 + task->readahead_pages);
+        if (IS_ERROR(err)) {
+            WARN("%s: failed to read a file: %s", task->name, err2str(err));
+            return NULL;
+        }
+    }
+
+    task->next_fault_offset = offset + PAGE_SIZE;
+    return page;
+}
+
+/// Resolves a page fault in ELF segments. `region` is the first segment
+/// overlapping with the page.
+static paddr_t segment_pager(struct task *task, struct region *region,
+                             vaddr_t vaddr, pagefault_t fault,
+                             pageattrs_t *attrs) {
+    // A page could be shared by multiple segments: it's writable if any of
+    // them is writable.
+    struct elf64_phdr *phdr = region->phdr;
+    bool writable = false;
+    for (struct region *r = region; r && r->start < vaddr + PAGE_SIZE;
+         r = regions_next(&task->regions, r)) {
+        if (r->type == REGION_SEGMENT) {
+            writable |= (r->phdr->p_flags & PF_W) != 0;
+        }
+    }
+
+    if ((fault & PF_PRESENT) && (!(fault & PF_WRITE) || !writable)) {
+        // Invalid access. For instance the user thread has tried to write to
+        // readonly area.
+        WARN("%s: invalid memory access at %p (perhaps segfault?)", task->name,
+             vaddr);
         return 0;
     }
-    // Allocate a page and fill it with the file data.
+
+    // Pages at page-aligned file offsets are shared among the tasks launched
+    // from the same file.
+    offset_t offset = (vaddr - phdr->p_vaddr) + phdr->p_offset;
+    bool shareable = IS_ALIGNED(offset, PAGE_SIZE)
+                     && offset / PAGE_SIZE < task->image->num_pages;
+    if (shareable && !(fault & PF_WRITE)) {
+        // A writable page is mapped as read-only too: it will be copied on
+        // the first write.
+        struct cached_page *page = get_cached_page(task, offset);
+        if (!page) {
+            return 0;
+        }
+
+        *attrs = 0;
+        return page->paddr;
+    }
+
+    // Allocate a private page and fill it with the file data.
     paddr_t paddr;
-    void *p = alloc_page(&paddr);
-    size_t offset_in_segment = (vaddr - phdr->p_vaddr) + phdr->p_offset;
-    error_t err =
-        read_file(task->fs_server, task->handle, offset_in_segment, p, PAGE_SIZE);
-    if (IS_ERROR(err)) {
-        WARN("%s: failed to read a file: %s", task->name, err2str(err));
-        return 0;
+    void *p = alloc_page(task, &paddr);
+    if (shareable && task->image->pages[offset / PAGE_SIZE].ptr) {
+        memcpy(p, task->image->pages[offset / PAGE_SIZE].ptr, PAGE_SIZE);
+    } else {
+        error_t err = read_file(task->fs_server, task->handle, offset, p,
+                                PAGE_SIZE);
+        if (IS_ERROR(err)) {
+            WARN("%s: failed to read a file: %s", task->name, err2str(err));
+            return 0;
+        }
     }
 
+    *attrs = writable ? PAGE_WRITABLE : 0;
     return paddr;
 }
 
+static paddr_t pager(struct task *task, vaddr_t vaddr, pagefault_t fault,
+                     pageattrs_t *attrs) {
+    struct region *region = regions_lookup(&task->regions, vaddr);
+    if (!region || region->start >= vaddr + PAGE_SIZE) {
+        WARN("invalid memory access (addr=%p), killing %s...", vaddr, task->name);
+        return 0;
+    }
+
+    switch (region->type) {
+        case REGION_ZEROED: {
+            // The accessed page is zeroed one (.bss section, stack, or heap).
+            if (!(fault & PF_WRITE)) {
+                if (fault & PF_PRESENT) {
+                    WARN("%s: invalid memory access at %p (perhaps segfault?)",
+                         task->name, vaddr);
+                    return 0;
+                }
+
+                // Map the shared zero page as read-only until the first write.
+                *attrs = 0;
+                return zero_page;
+            }
+
+            // The first write: allocate a private page. We don't need to copy
+            // the zero page.
+            paddr_t paddr;
+            alloc_zeroed_page(task, &paddr);
+            *attrs = PAGE_WRITABLE;
+            return paddr;
+        }
+        case REGION_SEGMENT:
+            return segment_pager(task, region, vaddr, fault, attrs);
+    }
+
+    UNREACHABLE();
+}
+
+/// Destroys the task and releases its resources. The task entry is kept until
+/// someone joins it.
 static void kill(struct task *task) {
+    TRACE("%s exited", task->name);
     task_destroy(task->tid);
-    task->in_use = false;
     free(task->file_header);
+    regions_free(&task->regions);
+
+    task->image->ref_count--;
+    if (task->image->stale && !task->image->ref_count) {
+        free_image(task->image);
+    }
+
+    // Return the pages to the pool to reuse them for other tasks.
+    LIST_FOR_EACH (page, &task->pages, struct page, next) {
+        list_remove(&page->next);
+        io_free_page(page->ptr, page->paddr);
+        free(page);
+    }
+
+    task->exited = true;
+    if (task->waiter) {
+        struct message m;
+        m.type = JOIN_REPLY_MSG;
+        ipc_reply(task->waiter, &m);
+        task->in_use = false;
+    }
 }
 
 void main(void) {
@@ -186,8 +592,11 @@ void main(void) {
         tasks[i].tid = TID_BASE + i;
     }
 
-    init_server = ipc_lookup("init");
-    ASSERT_OK(init_server);
+    list_init(&images);
+    list_init(&zeroed_pool);
+
+    void *zero_page_ptr = alloc_page(NULL, &zero_page);
+    memset(zero_page_ptr, 0, PAGE_SIZE);
 
     // The mainloop: receive and handle messages.
     INFO("ready");
@@ -197,15 +606,18 @@ void main(void) {
         ASSERT_OK(err);
 
         switch (m.type) {
+            case NOTIFICATIONS_MSG:
+                if (m.notifications.data & NOTIFY_TIMER) {
+                    refill_timer_set = false;
+                    io_refill_page_pool();
+                    refill_zeroed_pool(ZEROED_POOL_REFILL_BATCH);
+                    schedule_zeroed_pool_refill();
+                }
+                break;
             case EXCEPTION_MSG: {
-                struct task *task = get_task_by_tid(m.join.task);
+                struct task *task = get_task_by_tid(m.exception.task);
                 ASSERT(task);
-                TRACE("%s exited", task->name);
-                task->exited = true;
-                if (task->waiter) {
-                    m.type = JOIN_REPLY_MSG;
-                    ipc_reply(task->waiter, &m);
-                }
+                kill(task);
                 break;
             }
             case PAGE_FAULT_MSG: {
@@ -219,17 +631,20 @@ void main(void) {
                 ASSERT(task);
                 ASSERT(m.page_fault.task == task->tid);
 
+                pageattrs_t attrs;
                 paddr_t paddr =
-                    pager(task, m.page_fault.vaddr, m.page_fault.fault);
+                    pager(task, m.page_fault.vaddr, m.page_fault.fault, &attrs);
                 if (paddr) {
                     m.type = PAGE_FAULT_REPLY_MSG;
                     m.page_fault_reply.paddr = paddr;
-                    m.page_fault_reply.attrs = PAGE_WRITABLE;
+                    m.page_fault_reply.attrs = attrs;
                     error_t err = ipc_send_noblock(task->tid, &m);
                     ASSERT_OK(err);
                 } else {
                     kill(task);
                 }
+
+                schedule_zeroed_pool_refill();
                 break;
             }
             case EXEC_MSG: {
@@ -254,6 +669,7 @@ void main(void) {
                 if (task->exited) {
                     m.type = JOIN_REPLY_MSG;
                     ipc_reply(m.src, &m);
+                    task->in_use = false;
                 } else {
                     task->waiter = m.src;
                 }
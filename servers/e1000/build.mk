@@ -1,2 +1,2 @@
 name := e1000
-objs := main.o e1000.o pci.o
+objs := main.o e1000.o
@@ -1,11 +1,11 @@
 #include <message.h>
 #include <std/lookup.h>
 #include <std/malloc.h>
+#include <std/pci.h>
 #include <std/printf.h>
 #include <std/syscall.h>
 #include <cstring.h>
 #include "e1000.h"
-#include "pci.h"
 
 static task_t tcpip_tid;
 
@@ -0,0 +1,400 @@
+#include <std/malloc.h>
+#include <std/printf.h>
+#include <cstring.h>
+#include "bcache.h"
+
+/// The underlying block device.
+static void (*device_read)(offset_t sector, void *buf, size_t num_sectors);
+static void (*device_write)(offset_t sector, const void *buf,
+                            size_t num_sectors);
+/// Starts reading blocks asynchronously and handles completed reads. NULL if
+/// it's not supported.
+static bool (*device_async_read)(offset_t block, size_t num_blocks) = NULL;
+static void (*device_poll)(void) = NULL;
+/// The number of sectors in the device. 0 if it's unknown.
+static size_t device_num_sectors = 0;
+/// Cached blocks hashed by the block number.
+static list_t buckets[BCACHE_NUM_BUCKETS];
+/// Cached blocks ordered from the least recently used one.
+static list_t lru;
+static size_t num_blocks = 0;
+static size_t max_blocks;
+/// Dirty blocks sorted by the block number.
+static list_t dirty_blocks;
+static size_t num_dirty = 0;
+/// The cache is written back once it has more dirty blocks than this.
+static size_t max_dirty;
+static size_t num_in_flight = 0;
+/// The block next to the last missed or read ahead one, and the current
+/// readahead window.
+static offset_t next_miss = 0;
+static size_t readahead = 0;
+/// The first block of the last asynchronous readahead. Accessing it starts
+/// reading the next blocks ahead. NO_BLOCK if there's no such block.
+#define NO_BLOCK ((offset_t) -1)
+static offset_t readahead_trigger = NO_BLOCK;
+static struct bcache_stats stats;
+
+static list_t *get_bucket(offset_t block) {
+    return &buckets[block % BCACHE_NUM_BUCKETS];
+}
+
+static struct bcache_block *lookup(offset_t block) {
+    LIST_FOR_EACH (b, get_bucket(block), struct bcache_block, bucket_next) {
+        if (b->block == block) {
+            return b;
+        }
+    }
+
+    return NULL;
+}
+
+/// Marks the block as the most recently used one.
+static void touch(struct bcache_block *b) {
+    list_remove(&b->lru_next);
+    list_push_back(&lru, &b->lru_next);
+}
+
+/// Allocates a cache block, evicting the least recently used one if the cache
+/// is full.
+static struct bcache_block *alloc_block(offset_t block) {
+    struct bcache_block *b;
+    if (num_blocks < max_blocks) {
+        b = malloc(sizeof(*b));
+        num_blocks++;
+    } else {
+        // A dirty block must be written back before being evicted. Write back
+        // all of them at once rather than one by one.
+        ASSERT(!list_is_empty(&lru));
+        if (LIST_CONTAINER(lru.next, struct bcache_block, lru_next)->dirty) {
+            bcache_flush();
+        }
+
+        b = LIST_POP_FRONT(&lru, struct bcache_block, lru_next);
+        list_remove(&b->bucket_next);
+    }
+
+    b->block = block;
+    b->dirty = false;
+    b->in_flight = false;
+    list_push_back(get_bucket(block), &b->bucket_next);
+    list_push_back(&lru, &b->lru_next);
+    return b;
+}
+
+/// Returns the number of sectors in the block. The last block could be
+/// shorter than the others.
+static size_t block_num_sectors(offset_t block) {
+    offset_t sector = block * BCACHE_BLOCK_SECTORS;
+    if (!device_num_sectors) {
+        return BCACHE_BLOCK_SECTORS;
+    }
+
+    return MIN(BCACHE_BLOCK_SECTORS, device_num_sectors - sector);
+}
+
+static bool is_valid_block(offset_t block) {
+    return !device_num_sectors
+           || block * BCACHE_BLOCK_SECTORS < device_num_sectors;
+}
+
+/// Returns the number of blocks from `first` (up to `max`) which can be read
+/// ahead: blocks in the device which are neither cached nor in flight.
+static size_t count_uncached(offset_t first, size_t max) {
+    size_t n = 0;
+    while (n < max && is_valid_block(first + n) && !lookup(first + n)) {
+        n++;
+    }
+
+    return n;
+}
+
+static void grow_readahead(void) {
+    readahead =
+        MIN(MAX(readahead * 2, BCACHE_READAHEAD_MIN), BCACHE_READAHEAD_MAX);
+}
+
+/// Starts reading the blocks in background if possible. They're cached as
+/// in-flight blocks so that they're neither read again nor evicted until
+/// `bcache_insert` completes them.
+static bool read_async(offset_t first, size_t n) {
+    if (!device_async_read || num_in_flight + n > max_blocks / 2
+        || block_num_sectors(first + n - 1) != BCACHE_BLOCK_SECTORS
+        || !device_async_read(first, n)) {
+        return false;
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        struct bcache_block *b = alloc_block(first + i);
+        list_remove(&b->lru_next);
+        b->in_flight = true;
+    }
+
+    num_in_flight += n;
+    readahead_trigger = first;
+    return true;
+}
+
+/// Marks the in-flight block as read.
+static void complete_block(struct bcache_block *b) {
+    b->in_flight = false;
+    list_push_back(&lru, &b->lru_next);
+    num_in_flight--;
+}
+
+/// Waits for the in-flight block. Completion notifications can't be received
+/// while handling a request: this polls completed reads and reads the block
+/// synchronously if it's still in flight.
+static struct bcache_block *wait_block(offset_t block) {
+    device_poll();
+    struct bcache_block *b = lookup(block);
+    if (!b) {
+        // The asynchronous read has failed.
+        b = alloc_block(block);
+    } else if (!b->in_flight) {
+        return b;
+    } else {
+        complete_block(b);
+    }
+
+    device_read(block * BCACHE_BLOCK_SECTORS, b->data,
+                block_num_sectors(block));
+    return b;
+}
+
+/// Reads the blocks following the last readahead in background while the
+/// read-ahead blocks are being accessed. The window keeps growing as long as
+/// the access is sequential.
+static void readahead_next(void) {
+    readahead_trigger = NO_BLOCK;
+    grow_readahead();
+    size_t n = count_uncached(next_miss, MIN(readahead, max_blocks - 1));
+    if (n > 0 && read_async(next_miss, n)) {
+        stats.readahead_blocks += n;
+        next_miss += n;
+    }
+}
+
+/// Reads the missed block and the following blocks from the device at once.
+static struct bcache_block *fill(offset_t block) {
+    // Grow the readahead window while the misses are sequential.
+    if (block == next_miss && device_num_sectors) {
+        grow_readahead();
+    } else {
+        readahead = 0;
+    }
+
+    size_t n = 1 + count_uncached(block + 1, MIN(readahead, max_blocks - 1));
+    stats.misses++;
+    stats.readahead_blocks += n - 1;
+    next_miss = block + n;
+
+    // Read the following blocks in background if possible.
+    if (n > 1 && read_async(block + 1, n - 1)) {
+        n = 1;
+    }
+
+    offset_t last = block + n - 1;
+    size_t num_sectors = (n - 1) * BCACHE_BLOCK_SECTORS + block_num_sectors(last);
+    uint8_t *buf = malloc(num_sectors * SECTOR_SIZE);
+    device_read(block * BCACHE_BLOCK_SECTORS, buf, num_sectors);
+
+    // Insert the readahead blocks first so that the requested one is the most
+    // recently used.
+    for (size_t i = n; i > 0; i--) {
+        struct bcache_block *b = alloc_block(block + i - 1);
+        memcpy(b->data, &buf[(i - 1) * BCACHE_BLOCK_SIZE],
+               block_num_sectors(block + i - 1) * SECTOR_SIZE);
+    }
+
+    free(buf);
+    return lookup(block);
+}
+
+/// Reads sectors through the cache. This has the same interface as the
+/// `blk_read` callback of `fat_probe`.
+void bcache_read(offset_t sector, void *buf, size_t num_sectors) {
+    uint8_t *p = buf;
+    while (num_sectors > 0) {
+        offset_t block = sector / BCACHE_BLOCK_SECTORS;
+        size_t off = sector % BCACHE_BLOCK_SECTORS;
+        size_t n = MIN(num_sectors, BCACHE_BLOCK_SECTORS - off);
+
+        if (block == readahead_trigger) {
+            // Request the next blocks before waiting for this one.
+            readahead_next();
+        }
+
+        struct bcache_block *b = lookup(block);
+        if (b && b->in_flight) {
+            stats.hits++;
+            b = wait_block(block);
+        } else if (b) {
+            stats.hits++;
+            touch(b);
+        } else {
+            b = fill(block);
+        }
+
+        memcpy(p, &b->data[off * SECTOR_SIZE], n * SECTOR_SIZE);
+        p += n * SECTOR_SIZE;
+        sector += n;
+        num_sectors -= n;
+    }
+}
+
+static void mark_dirty(struct bcache_block *b) {
+    if (b->dirty) {
+        return;
+    }
+
+    // Keep the list sorted. Writes are usually sequential: look for the
+    // position from the tail.
+    list_elem_t *prev = dirty_blocks.prev;
+    while (prev != &dirty_blocks
+           && LIST_CONTAINER(prev, struct bcache_block, dirty_next)->block
+                  > b->block) {
+        prev = prev->prev;
+    }
+
+    list_insert(prev, prev->next, &b->dirty_next);
+    b->dirty = true;
+    num_dirty++;
+}
+
+/// Writes sectors into the cache. They're written back to the device later by
+/// `bcache_flush`. This has the same interface as the `blk_write` callback of
+/// `fat_probe`.
+void bcache_write(offset_t sector, const void *buf, size_t num_sectors) {
+    const uint8_t *p = buf;
+    while (num_sectors > 0) {
+        offset_t block = sector / BCACHE_BLOCK_SECTORS;
+        size_t off = sector % BCACHE_BLOCK_SECTORS;
+        size_t n = MIN(num_sectors, BCACHE_BLOCK_SECTORS - off);
+
+        bool overwritten = off == 0 && n == block_num_sectors(block);
+        struct bcache_block *b = lookup(block);
+        if (b && b->in_flight) {
+            // The data being read is ignored if it's overwritten.
+            if (overwritten) {
+                complete_block(b);
+            } else {
+                b = wait_block(block);
+            }
+        } else if (b) {
+            touch(b);
+        } else if (overwritten) {
+            // The whole block is overwritten: no need to read it.
+            b = alloc_block(block);
+        } else {
+            b = fill(block);
+        }
+
+        memcpy(&b->data[off * SECTOR_SIZE], p, n * SECTOR_SIZE);
+        mark_dirty(b);
+        p += n * SECTOR_SIZE;
+        sector += n;
+        num_sectors -= n;
+    }
+
+    if (num_dirty > max_dirty) {
+        bcache_flush();
+    }
+}
+
+/// Writes back all dirty blocks. Contiguous blocks are written by a single
+/// request.
+void bcache_flush(void) {
+    if (list_is_empty(&dirty_blocks)) {
+        return;
+    }
+
+    uint8_t *buf = malloc(BCACHE_WRITE_MAX_SECTORS * SECTOR_SIZE);
+    while (!list_is_empty(&dirty_blocks)) {
+        struct bcache_block *first =
+            LIST_CONTAINER(dirty_blocks.next, struct bcache_block, dirty_next);
+        offset_t sector = first->block * BCACHE_BLOCK_SECTORS;
+        offset_t next = first->block;
+        size_t num_sectors = 0;
+        while (!list_is_empty(&dirty_blocks)) {
+            struct bcache_block *b = LIST_CONTAINER(
+                dirty_blocks.next, struct bcache_block, dirty_next);
+            size_t n = block_num_sectors(b->block);
+            if (b->block != next
+                || num_sectors + n > BCACHE_WRITE_MAX_SECTORS) {
+                break;
+            }
+
+            memcpy(&buf[num_sectors * SECTOR_SIZE], b->data, n * SECTOR_SIZE);
+            list_remove(&b->dirty_next);
+            b->dirty = false;
+            num_dirty--;
+            stats.written_blocks++;
+            num_sectors += n;
+            next++;
+        }
+
+        device_write(sector, buf, num_sectors);
+    }
+
+    free(buf);
+}
+
+/// Completes a block read asynchronously. `data` is NULL if the read has
+/// failed or the data is stale. It's ignored if the block has been read
+/// synchronously in the meantime.
+void bcache_insert(offset_t block, const void *data) {
+    struct bcache_block *b = lookup(block);
+    if (!b || !b->in_flight) {
+        return;
+    }
+
+    if (!data) {
+        list_remove(&b->bucket_next);
+        free(b);
+        num_blocks--;
+        num_in_flight--;
+        return;
+    }
+
+    memcpy(b->data, data, BCACHE_BLOCK_SIZE);
+    complete_block(b);
+}
+
+/// Enables asynchronous readahead. `async_read` starts reading whole blocks
+/// and returns false if it can't accept the request. `poll` completes finished
+/// reads by `bcache_insert`.
+void bcache_set_async_read(bool (*async_read)(offset_t block,
+                                              size_t num_blocks),
+                           void (*poll)(void)) {
+    device_async_read = async_read;
+    device_poll = poll;
+}
+
+/// Sets the size of the device. Readahead is disabled until it's set not to
+/// read beyond the end of the device.
+void bcache_set_num_sectors(size_t num_sectors) {
+    device_num_sectors = num_sectors;
+}
+
+struct bcache_stats *bcache_stats(void) {
+    return &stats;
+}
+
+/// Initializes the cache. `budget` is the maximum amount of memory in bytes
+/// used for cached data.
+void bcache_init(void (*blk_read)(offset_t sector, void *buf,
+                                  size_t num_sectors),
+                 void (*blk_write)(offset_t sector, const void *buf,
+                                   size_t num_sectors),
+                 size_t budget) {
+    device_read = blk_read;
+    device_write = blk_write;
+    max_blocks = MAX(budget / BCACHE_BLOCK_SIZE, 1);
+    max_dirty = MAX(max_blocks / 2, 1);
+    list_init(&lru);
+    list_init(&dirty_blocks);
+    for (int i = 0; i < BCACHE_NUM_BUCKETS; i++) {
+        list_init(&buckets[i]);
+    }
+}
@@ -0,0 +1,60 @@
+#ifndef __BCACHE_H__
+#define __BCACHE_H__
+
+#include <list.h>
+#include <types.h>
+#include "fat.h"
+
+/// The number of sectors in a cache block.
+#define BCACHE_BLOCK_SECTORS 8
+#define BCACHE_BLOCK_SIZE    (BCACHE_BLOCK_SECTORS * SECTOR_SIZE)
+/// The number of buckets in the block lookup table.
+#define BCACHE_NUM_BUCKETS 256
+/// The initial and the maximum numbers of blocks read ahead on sequential
+/// misses.
+#define BCACHE_READAHEAD_MIN 2
+#define BCACHE_READAHEAD_MAX 32
+/// The maximum number of sectors written to the device at once.
+#define BCACHE_WRITE_MAX_SECTORS 128
+
+/// A cached block: `BCACHE_BLOCK_SECTORS` consecutive sectors.
+struct bcache_block {
+    /// The next element in the LRU list.
+    list_elem_t lru_next;
+    /// The next element in the lookup table bucket.
+    list_elem_t bucket_next;
+    /// The next element in the dirty block list (if `dirty` is true).
+    list_elem_t dirty_next;
+    /// True if the block is modified and not yet written back.
+    bool dirty;
+    /// True if the block is being read asynchronously. Its data is not valid
+    /// yet and it's not in the LRU list until the read completes.
+    bool in_flight;
+    /// The block number (the first sector / BCACHE_BLOCK_SECTORS).
+    offset_t block;
+    uint8_t data[BCACHE_BLOCK_SIZE];
+};
+
+struct bcache_stats {
+    size_t hits;
+    size_t misses;
+    size_t readahead_blocks;
+    size_t written_blocks;
+};
+
+void bcache_init(void (*blk_read)(offset_t sector, void *buf,
+                                  size_t num_sectors),
+                 void (*blk_write)(offset_t sector, const void *buf,
+                                   size_t num_sectors),
+                 size_t budget);
+void bcache_set_num_sectors(size_t num_sectors);
+void bcache_set_async_read(bool (*async_read)(offset_t block,
+                                              size_t num_blocks),
+                           void (*poll)(void));
+void bcache_insert(offset_t block, const void *data);
+void bcache_read(offset_t sector, void *buf, size_t num_sectors);
+void bcache_write(offset_t sector, const void *buf, size_t num_sectors);
+void bcache_flush(void);
+struct bcache_stats *bcache_stats(void);
+
+#endif
@@ -1,2 +1,2 @@
 name := fatfs
-objs := main.o fat.o
+objs := main.o fat.o bcache.o
@@ -61,6 +61,30 @@ error_t fat_probe(struct fat *fs,
     fs->fat_lba = bpb.num_reserved_sectors;
     fs->root_dir_lba = fs->fat_lba + sectors_per_fat * bpb.num_fat;
     fs->data_lba = fs->root_dir_lba + root_dir_sectors;
+    fs->num_sectors = sectors;
+    fs->sectors_per_fat = sectors_per_fat;
+    fs->num_fats = bpb.num_fat;
+    fs->num_fat_entries = (sectors_per_fat * SECTOR_SIZE) / sizeof(uint16_t);
+    fs->num_clusters = MIN(total_data_clus, fs->num_fat_entries - 2);
+    fs->fat_cache = malloc(sectors_per_fat * SECTOR_SIZE);
+    size_t num_chunks =
+        ALIGN_UP(sectors_per_fat, FAT_CACHE_CHUNK_SECTORS)
+        / FAT_CACHE_CHUNK_SECTORS;
+    fs->fat_cache_loaded = malloc(sizeof(bool) * num_chunks);
+    memset(fs->fat_cache_loaded, 0, sizeof(bool) * num_chunks);
+    fs->fat_dirty = malloc(sizeof(bool) * sectors_per_fat);
+    memset(fs->fat_dirty, 0, sizeof(bool) * sectors_per_fat);
+    fs->num_free_clusters = -1;
+    fs->num_reserved_clusters = 0;
+    fs->next_free = 2;
+    list_init(&fs->open_files);
+    for (int i = 0; i < DCACHE_NUM_BUCKETS; i++) {
+        list_init(&fs->dentry_buckets[i]);
+    }
+    list_init(&fs->dentry_lru);
+    fs->num_dentries = 0;
+    list_init(&fs->modified_files);
+    fs->last_version = 0;
     return OK;
 }
 
@@ -71,6 +95,12 @@ static bool is_end_of_cluster(struct fat *fs, cluster_t cluster) {
     }
 }
 
+static cluster_t end_of_cluster(struct fat *fs) {
+    switch (fs->type) {
+        case FAT16: return 0xffff;
+    }
+}
+
 static bool is_free_cluster(cluster_t cluster) {
     return cluster == 0;
 }
@@ -79,10 +109,10 @@ static bool is_valid_cluster(struct fat *fs, cluster_t cluster) {
     return !is_end_of_cluster(fs, cluster) && !is_free_cluster(cluster);
 }
 
-static bool filename_equals(struct fat_dirent *e, const char *name,
-                            const char *ext) {
+/// Extracts the name and the extension of the entry without trailing spaces.
+static void get_dirent_name(struct fat_dirent *e, char *name, char *ext) {
     int name_len = 8;
-    while (name_len >= 0 && e->name[name_len - 1] == ' ') {
+    while (name_len > 0 && e->name[name_len - 1] == ' ') {
         name_len--;
     }
 
@@ -91,8 +121,10 @@ static bool filename_equals(struct fat_dirent *e, const char *name,
         ext_len--;
     }
 
-    return !strncmp((const char *) e->name, name, name_len)
-        && !strncmp((const char *) e->ext, ext, ext_len);
+    memcpy(name, e->name, name_len);
+    name[name_len] = '\0';
+    memcpy(ext, e->ext, ext_len);
+    ext[ext_len] = '\0';
 }
 
 static char *get_next_filename(char *path, char *name, char *ext) {
@@ -133,147 +165,774 @@ static offset_t cluster2lba(struct fat *fs, cluster_t cluster) {
     return (((cluster - 2) * fs->sectors_per_cluster) + fs->data_lba);
 }
 
-static offset_t get_next_cluster(struct fat *fs, cluster_t cluster) {
+/// Loads the chunk of the FAT table which contains the entry of the cluster if
+/// it's not yet cached.
+static void load_fat_chunk(struct fat *fs, cluster_t cluster) {
+    size_t entries_per_chunk =
+        (FAT_CACHE_CHUNK_SECTORS * SECTOR_SIZE) / sizeof(uint16_t);
+    size_t chunk = cluster / entries_per_chunk;
+    if (!fs->fat_cache_loaded[chunk]) {
+        size_t first = chunk * FAT_CACHE_CHUNK_SECTORS;
+        size_t num_sectors =
+            MIN(FAT_CACHE_CHUNK_SECTORS, fs->sectors_per_fat - first);
+        fs->blk_read(fs->fat_lba + first,
+                     (uint8_t *) fs->fat_cache + first * SECTOR_SIZE,
+                     num_sectors);
+        fs->fat_cache_loaded[chunk] = true;
+    }
+}
+
+static cluster_t get_next_cluster(struct fat *fs, cluster_t cluster) {
     DEBUG_ASSERT(cluster >= 2);
-    size_t fat_ent_size, entries_per_sector;
+    ASSERT(cluster < fs->num_fat_entries);
+
+    load_fat_chunk(fs, cluster);
     switch (fs->type) {
         case FAT16:
-            fat_ent_size = 2;
-            entries_per_sector = SECTOR_SIZE / sizeof(uint16_t);
-            break;
+            return fs->fat_cache[cluster];
     }
+}
 
-    uint8_t buf[SECTOR_SIZE];
-    fs->blk_read(fs->fat_lba + (cluster / entries_per_sector), &buf, 1);
+/// Updates the entry in the FAT table cache. Modified sectors are written
+/// back at once by `fat_sync`.
+static void set_next_cluster(struct fat *fs, cluster_t cluster,
+                             cluster_t next) {
+    DEBUG_ASSERT(cluster >= 2);
+    ASSERT(cluster < fs->num_fat_entries);
 
+    load_fat_chunk(fs, cluster);
     switch (fs->type) {
-        case FAT16: {
-            return ((uint16_t *) buf)[cluster % entries_per_sector];
+        case FAT16:
+            fs->fat_cache[cluster] = next;
+            fs->fat_dirty[(cluster * sizeof(uint16_t)) / SECTOR_SIZE] = true;
+            break;
+    }
+}
+
+/// Builds the extent list of the file from its cluster chain.
+static void build_extents(struct fat *fs, struct fat_file *file) {
+    // Count the extents first. The chain could be longer than the file size
+    // requires: follow it to the end not to lose the clusters.
+    size_t num_extents = 0;
+    cluster_t prev = 0;
+    cluster_t current = file->cluster;
+    for (size_t i = 0; i < fs->num_clusters && is_valid_cluster(fs, current);
+         i++) {
+        if (current != prev + 1) {
+            num_extents++;
+        }
+
+        prev = current;
+        current = get_next_cluster(fs, current);
+    }
+
+    file->extents = malloc(sizeof(struct fat_extent) * MAX(num_extents, 1));
+    file->num_extents = 0;
+    file->num_clusters = 0;
+    prev = 0;
+    current = file->cluster;
+    for (size_t i = 0; i < fs->num_clusters && is_valid_cluster(fs, current);
+         i++) {
+        if (current != prev + 1) {
+            struct fat_extent *extent = &file->extents[file->num_extents++];
+            extent->index = i;
+            extent->cluster = current;
+            extent->num_clusters = 0;
+        }
+
+        file->extents[file->num_extents - 1].num_clusters++;
+        file->num_clusters++;
+        prev = current;
+        current = get_next_cluster(fs, current);
+    }
+}
+
+/// Returns the extent which contains the `nth` cluster of the file or NULL if
+/// it's out of the file.
+static struct fat_extent *find_extent(struct fat_file *file, size_t nth) {
+    // Look for the last extent which begins at or before `nth`.
+    size_t lo = 0;
+    size_t hi = file->num_extents;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (file->extents[mid].index <= nth) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
         }
     }
+
+    if (lo == 0) {
+        return NULL;
+    }
+
+    struct fat_extent *extent = &file->extents[lo - 1];
+    if (nth >= extent->index + extent->num_clusters) {
+        return NULL;
+    }
+
+    return extent;
 }
 
-static void open_root_dir(struct fat *fs, struct fat_dir *dir) {
+/// Opens the directory which begins at `cluster`. 0 means the root directory.
+static void open_dir(struct fat *fs, struct fat_dir *dir, cluster_t cluster) {
     offset_t lba;
-    switch (fs->type) {
-        case FAT16:
-            // In FAT16, root directory entries is located in front of data
-            // clusters.
-            dir->cluster = 0;
-            lba = fs->root_dir_lba;
-            break;
+    size_t num_sectors;
+    if (cluster) {
+        lba = cluster2lba(fs, cluster);
+        num_sectors = fs->sectors_per_cluster;
+    } else {
+        switch (fs->type) {
+            case FAT16:
+                // In FAT16, root directory entries is located in front of data
+                // clusters.
+                lba = fs->root_dir_lba;
+                num_sectors = fs->data_lba - fs->root_dir_lba;
+                break;
+        }
     }
 
-    dir->entries = malloc(fs->sectors_per_cluster * SECTOR_SIZE);
+    dir->cluster = cluster;
+    dir->entries = malloc(num_sectors * SECTOR_SIZE);
+    dir->num_entries = (num_sectors * SECTOR_SIZE) / sizeof(struct fat_dirent);
     dir->index = 0;
-    fs->blk_read(lba, dir->entries, fs->sectors_per_cluster);
+    dir->base = 0;
+    fs->blk_read(lba, dir->entries, num_sectors);
 }
 
-static void opendir_from_dirent(struct fat *fs, struct fat_dir *dir,
-                             struct fat_dirent *e) {
-    dir->cluster = get_cluster_from_entry(e);
-    dir->entries = malloc(fs->sectors_per_cluster * SECTOR_SIZE);
-    dir->index = 0;
-    fs->blk_read(cluster2lba(fs, dir->cluster), dir->entries,
-                 fs->sectors_per_cluster);
+/// Computes the location of the `index`-th entry in the current cluster of the
+/// directory.
+static void get_dirent_location(struct fat *fs, struct fat_dir *dir, int index,
+                                offset_t *lba, size_t *index_in_sector) {
+    offset_t base = dir->cluster ? cluster2lba(fs, dir->cluster)
+                                 : fs->root_dir_lba;
+    size_t off = index * sizeof(struct fat_dirent);
+    *lba = base + off / SECTOR_SIZE;
+    *index_in_sector = (off % SECTOR_SIZE) / sizeof(struct fat_dirent);
+}
+
+/// Looks for the name in the directory. This scans the directory entries.
+static bool search_dir(struct fat *fs, cluster_t parent, const char *name,
+                       const char *ext, struct fat_dirent *result,
+                       offset_t *lba, size_t *index) {
+    struct fat_dir dir;
+    open_dir(fs, &dir, parent);
+
+    bool found = false;
+    struct fat_dirent *e;
+    while ((e = fat_readdir(fs, &dir)) != NULL) {
+        char e_name[9];
+        char e_ext[4];
+        get_dirent_name(e, e_name, e_ext);
+        if (!strcmp(e_name, name) && !strcmp(e_ext, ext)) {
+            *result = *e;
+            get_dirent_location(fs, &dir, dir.index - 1, lba, index);
+            found = true;
+            break;
+        }
+    }
+
+    fat_closedir(fs, &dir);
+    return found;
+}
+
+static list_t *get_dentry_bucket(struct fat *fs, cluster_t parent,
+                                 const char *name, const char *ext) {
+    // FNV-1a.
+    uint32_t hash = 2166136261 ^ parent;
+    for (const char *p = name; *p; p++) {
+        hash = (hash ^ *p) * 16777619;
+    }
+
+    for (const char *p = ext; *p; p++) {
+        hash = (hash ^ *p) * 16777619;
+    }
+
+    return &fs->dentry_buckets[hash % DCACHE_NUM_BUCKETS];
+}
+
+/// Looks for the name in the directory through the directory entry cache.
+static struct fat_dentry *lookup_dentry(struct fat *fs, cluster_t parent,
+                                        const char *name, const char *ext) {
+    list_t *bucket = get_dentry_bucket(fs, parent, name, ext);
+    LIST_FOR_EACH (d, bucket, struct fat_dentry, bucket_next) {
+        if (d->parent == parent && !strcmp(d->name, name)
+            && !strcmp(d->ext, ext)) {
+            // Mark it as the most recently used one.
+            list_remove(&d->lru_next);
+            list_push_back(&fs->dentry_lru, &d->lru_next);
+            return d;
+        }
+    }
+
+    // Not in the cache. Evict the least recently used entry if the cache is
+    // full.
+    struct fat_dentry *d;
+    if (fs->num_dentries < DCACHE_MAX_ENTRIES) {
+        d = malloc(sizeof(*d));
+        fs->num_dentries++;
+    } else {
+        d = LIST_POP_FRONT(&fs->dentry_lru, struct fat_dentry, lru_next);
+        list_remove(&d->bucket_next);
+    }
+
+    d->parent = parent;
+    strncpy(d->name, name, sizeof(d->name));
+    strncpy(d->ext, ext, sizeof(d->ext));
+    d->negative =
+        !search_dir(fs, parent, name, ext, &d->entry, &d->lba, &d->index);
+    list_push_back(bucket, &d->bucket_next);
+    list_push_back(&fs->dentry_lru, &d->lru_next);
+    return d;
 }
 
-/// Looks for the file from the root directory.
-static struct fat_dirent *lookup(struct fat *fs, const char *path) {
+/// Looks for the file from the root directory. The returned entry is valid
+/// until the next lookup.
+static struct fat_dentry *lookup(struct fat *fs, const char *path) {
     char *p = (char *) path;
     if (*p == '/') {
         p++;
     }
 
-    struct fat_dir dir;
-    open_root_dir(fs, &dir);
-    while(1) {
+    cluster_t parent = 0;
+    while (1) {
         char name[9];
         char ext[4];
         p = get_next_filename(p, (char *) name, (char *) ext);
-        while (1) {
-            struct fat_dirent *e = fat_readdir(fs, &dir);
-            if (!e) {
-                // No such a file.
-                return NULL;
-            }
-
-            if (filename_equals(e, (const char *) name, (const char *) ext)) {
-                if (!p) {
-                    // Found the file!
-                    return e;
-                }
+        struct fat_dentry *d = lookup_dentry(fs, parent, name, ext);
+        if (d->negative) {
+            // No such a file.
+            return NULL;
+        }
 
-                // Enter the next directory level.
-                opendir_from_dirent(fs, &dir, e);
-                break;
-            }
+        if (!p) {
+            // Found the file!
+            return d;
         }
+
+        // Enter the next directory level.
+        parent = get_cluster_from_entry(&d->entry);
     }
 }
 
-error_t fat_open(struct fat *fs, struct fat_file *file, const char *path) {
-    struct fat_dirent *e = lookup(fs, path);
-    if (!e) {
+/// Opens a file. A file opened multiple times shares the same
+/// `struct fat_file`.
+error_t fat_open(struct fat *fs, const char *path, struct fat_file **file) {
+    struct fat_dentry *d = lookup(fs, path);
+    if (!d) {
         return ERR_NOT_FOUND;
     }
 
-    file->cluster = get_cluster_from_entry(e);
-    file->size = e->size;
+    LIST_FOR_EACH (f, &fs->open_files, struct fat_file, next) {
+        if (f->dirent_lba == d->lba && f->dirent_index == d->index) {
+            f->ref_count++;
+            *file = f;
+            return OK;
+        }
+    }
+
+    struct fat_file *f = malloc(sizeof(*f));
+    f->ref_count = 1;
+    f->dirent_lba = d->lba;
+    f->dirent_index = d->index;
+    f->dirent_dirty = false;
+    f->cluster = get_cluster_from_entry(&d->entry);
+    f->size = d->entry.size;
+    f->delayed = NULL;
+    f->delayed_len = 0;
+    f->delayed_capacity = 0;
+    f->modified = NULL;
+    LIST_FOR_EACH (m, &fs->modified_files, struct fat_modified, next) {
+        if (m->dirent_lba == d->lba && m->dirent_index == d->index) {
+            f->modified = m;
+            break;
+        }
+    }
+
+    build_extents(fs, f);
+    list_push_back(&fs->open_files, &f->next);
+    *file = f;
+    return OK;
+}
+
+/// Creates an empty file. Directories are not extended: it fails if the
+/// parent directory has no unused entries.
+error_t fat_create(struct fat *fs, const char *path) {
+    // Split the path into the parent directory and the file name.
+    const char *basename = path;
+    for (const char *p = path; *p; p++) {
+        if (*p == '/') {
+            basename = p + 1;
+        }
+    }
+
+    cluster_t parent = 0;
+    size_t parent_len = basename - path;
+    if (parent_len > 1) {
+        char *parent_path = malloc(parent_len);
+        memcpy(parent_path, path, parent_len - 1);
+        parent_path[parent_len - 1] = '\0';
+        struct fat_dentry *d = lookup(fs, parent_path);
+        free(parent_path);
+        if (!d || !(d->entry.attr & FAT_ATTR_DIRECTORY)) {
+            return ERR_NOT_FOUND;
+        }
+
+        parent = get_cluster_from_entry(&d->entry);
+    }
+
+    char name[9];
+    char ext[4];
+    if (get_next_filename((char *) basename, name, ext) || !name[0]) {
+        return ERR_INVALID_ARG;
+    }
+
+    struct fat_dentry *d = lookup_dentry(fs, parent, name, ext);
+    if (!d->negative) {
+        return ERR_ALREADY_EXISTS;
+    }
+
+    // Look for an unused entry.
+    struct fat_dir dir;
+    open_dir(fs, &dir, parent);
+    while (true) {
+        while (dir.index < dir.num_entries
+               && dir.entries[dir.index].name[0] != 0x00
+               && dir.entries[dir.index].name[0] != 0xe5) {
+            dir.index++;
+        }
+
+        if (dir.index < dir.num_entries) {
+            break;
+        }
+
+        cluster_t next = dir.cluster ? get_next_cluster(fs, dir.cluster) : 0;
+        if (!is_valid_cluster(fs, next)) {
+            fat_closedir(fs, &dir);
+            return ERR_NO_MEMORY;
+        }
+
+        dir.cluster = next;
+        dir.index = 0;
+        fs->blk_read(cluster2lba(fs, dir.cluster), dir.entries,
+                     fs->sectors_per_cluster);
+    }
+
+    offset_t lba;
+    size_t index;
+    get_dirent_location(fs, &dir, dir.index, &lba, &index);
+    fat_closedir(fs, &dir);
+
+    struct fat_dirent e;
+    memset(&e, 0, sizeof(e));
+    memset(e.name, ' ', sizeof(e.name));
+    memset(e.ext, ' ', sizeof(e.ext));
+    memcpy(e.name, name, strlen(name));
+    memcpy(e.ext, ext, strlen(ext));
+    e.attr = FAT_ATTR_ARCHIVE;
+
+    struct fat_dirent entries[SECTOR_SIZE / sizeof(struct fat_dirent)];
+    fs->blk_read(lba, entries, 1);
+    entries[index] = e;
+    fs->blk_write(lba, entries, 1);
+
+    // It's no longer a negative entry.
+    d->negative = false;
+    d->entry = e;
+    d->lba = lba;
+    d->index = index;
     return OK;
 }
 
+/// Writes the size and the first cluster of the file into its directory entry.
+static void write_dirent(struct fat *fs, struct fat_file *file) {
+    struct fat_dirent entries[SECTOR_SIZE / sizeof(struct fat_dirent)];
+    fs->blk_read(file->dirent_lba, entries, 1);
+    struct fat_dirent *e = &entries[file->dirent_index];
+    e->size = file->size;
+    e->cluster_begin_low = file->cluster & 0xffff;
+    e->cluster_begin_high = file->cluster >> 16;
+    fs->blk_write(file->dirent_lba, entries, 1);
+
+    // Keep the cached entry up to date.
+    LIST_FOR_EACH (d, &fs->dentry_lru, struct fat_dentry, lru_next) {
+        if (!d->negative && d->lba == file->dirent_lba
+            && d->index == file->dirent_index) {
+            d->entry = *e;
+        }
+    }
+
+    file->dirent_dirty = false;
+}
+
+/// Returns the number of clusters to store `len` bytes.
+static size_t count_clusters(struct fat *fs, size_t len) {
+    size_t cluster_size = fs->sectors_per_cluster * SECTOR_SIZE;
+    return ALIGN_UP(len, cluster_size) / cluster_size;
+}
+
+/// Reserves free clusters for the delayed allocation. Returns false if there
+/// aren't enough free clusters.
+static bool reserve_clusters(struct fat *fs, size_t num_clusters) {
+    if (fs->num_free_clusters < 0) {
+        fs->num_free_clusters = 0;
+        for (cluster_t c = 2; c < fs->num_clusters + 2; c++) {
+            if (is_free_cluster(get_next_cluster(fs, c))) {
+                fs->num_free_clusters++;
+            }
+        }
+    }
+
+    if (fs->num_reserved_clusters + num_clusters
+        > (size_t) fs->num_free_clusters) {
+        return false;
+    }
+
+    fs->num_reserved_clusters += num_clusters;
+    return true;
+}
+
+/// Looks for `n` contiguous free clusters from `fs->next_free`. If there
+/// aren't, returns the longest run of free clusters instead. The number of
+/// clusters in the returned run is set to `len`.
+static cluster_t find_free_clusters(struct fat *fs, size_t n, size_t *len) {
+    cluster_t best = 0;
+    size_t best_len = 0;
+    cluster_t run = 0;
+    size_t run_len = 0;
+    for (size_t i = 0; i < fs->num_clusters && best_len < n; i++) {
+        cluster_t c = 2 + (fs->next_free - 2 + i) % fs->num_clusters;
+        if (c == 2) {
+            // A run does not wrap around.
+            run_len = 0;
+        }
+
+        if (!is_free_cluster(get_next_cluster(fs, c))) {
+            run_len = 0;
+            continue;
+        }
+
+        if (!run_len) {
+            run = c;
+        }
+
+        run_len++;
+        if (run_len > best_len) {
+            best = run;
+            best_len = run_len;
+        }
+    }
+
+    *len = MIN(best_len, n);
+    return best;
+}
+
+/// Appends contiguous free clusters to the file.
+static void append_clusters(struct fat *fs, struct fat_file *file,
+                            cluster_t first, size_t num_clusters) {
+    for (size_t i = 0; i < num_clusters; i++) {
+        cluster_t next =
+            (i + 1 < num_clusters) ? first + i + 1 : end_of_cluster(fs);
+        set_next_cluster(fs, first + i, next);
+    }
+
+    struct fat_extent *last =
+        file->num_extents ? &file->extents[file->num_extents - 1] : NULL;
+    if (last) {
+        set_next_cluster(fs, last->cluster + last->num_clusters - 1, first);
+    } else {
+        file->cluster = first;
+        file->dirent_dirty = true;
+    }
+
+    if (last && last->cluster + last->num_clusters == first) {
+        last->num_clusters += num_clusters;
+    } else {
+        struct fat_extent *extents =
+            malloc(sizeof(struct fat_extent) * (file->num_extents + 1));
+        memcpy(extents, file->extents,
+               sizeof(struct fat_extent) * file->num_extents);
+        free(file->extents);
+        file->extents = extents;
+        struct fat_extent *extent = &file->extents[file->num_extents++];
+        extent->index = file->num_clusters;
+        extent->cluster = first;
+        extent->num_clusters = num_clusters;
+    }
+
+    file->num_clusters += num_clusters;
+    fs->num_free_clusters -= num_clusters;
+    fs->next_free = 2 + (first + num_clusters - 2) % fs->num_clusters;
+}
+
+/// Writes data into the allocated clusters of the file.
+static void write_clusters(struct fat *fs, struct fat_file *file, offset_t off,
+                           const void *buf, size_t len) {
+    size_t cluster_size = fs->sectors_per_cluster * SECTOR_SIZE;
+    const uint8_t *p = buf;
+    while (len > 0) {
+        struct fat_extent *extent = find_extent(file, off / cluster_size);
+        ASSERT(extent);
+        offset_t extent_off = extent->index * cluster_size;
+        size_t extent_len = extent->num_clusters * cluster_size;
+        offset_t lba =
+            cluster2lba(fs, extent->cluster) + (off - extent_off) / SECTOR_SIZE;
+        size_t off_in_sector = off % SECTOR_SIZE;
+        size_t write_len = MIN(len, extent_off + extent_len - off);
+        if (off_in_sector || write_len < SECTOR_SIZE) {
+            // Update a part of the sector.
+            uint8_t tmp[SECTOR_SIZE];
+            write_len = MIN(write_len, SECTOR_SIZE - off_in_sector);
+            fs->blk_read(lba, tmp, 1);
+            memcpy(&tmp[off_in_sector], p, write_len);
+            fs->blk_write(lba, tmp, 1);
+        } else {
+            write_len = ALIGN_DOWN(write_len, SECTOR_SIZE);
+            fs->blk_write(lba, p, write_len / SECTOR_SIZE);
+        }
+
+        p += write_len;
+        off += write_len;
+        len -= write_len;
+    }
+}
+
+/// Allocates clusters for the delayed data and writes it into them.
+static void flush_delayed(struct fat *fs, struct fat_file *file) {
+    if (!file->delayed_len) {
+        return;
+    }
+
+    size_t cluster_size = fs->sectors_per_cluster * SECTOR_SIZE;
+    offset_t off = file->num_clusters * cluster_size;
+    size_t n = count_clusters(fs, file->delayed_len);
+    fs->num_reserved_clusters -= n;
+
+    // Extend the last extent if the following clusters are free.
+    if (file->num_extents > 0) {
+        struct fat_extent *last = &file->extents[file->num_extents - 1];
+        cluster_t next = last->cluster + last->num_clusters;
+        size_t len = 0;
+        while (len < n && next + len < fs->num_clusters + 2
+               && is_free_cluster(get_next_cluster(fs, next + len))) {
+            len++;
+        }
+
+        if (len > 0) {
+            append_clusters(fs, file, next, len);
+            n -= len;
+        }
+    }
+
+    while (n > 0) {
+        size_t len;
+        cluster_t first = find_free_clusters(fs, n, &len);
+        // We've reserved enough free clusters.
+        ASSERT(len > 0);
+        append_clusters(fs, file, first, len);
+        n -= len;
+    }
+
+    write_clusters(fs, file, off, file->delayed, file->delayed_len);
+    free(file->delayed);
+    file->delayed = NULL;
+    file->delayed_len = 0;
+    file->delayed_capacity = 0;
+}
+
+/// Writes back the delayed data and the directory entry of the file.
+static void sync_file(struct fat *fs, struct fat_file *file) {
+    flush_delayed(fs, file);
+    if (file->dirent_dirty) {
+        write_dirent(fs, file);
+    }
+}
+
+void fat_close(struct fat *fs, struct fat_file *file) {
+    file->ref_count--;
+    if (file->ref_count > 0) {
+        return;
+    }
+
+    sync_file(fs, file);
+    list_remove(&file->next);
+    free(file->extents);
+    free(file);
+}
+
 error_t fat_read(struct fat *fs, struct fat_file *file, offset_t off, void *buf,
                  size_t len) {
-    if (off + len < file->size && off + len < off) {
+    if (off + len > file->size || off + len < off) {
         return ERR_TOO_LARGE;
     }
 
-    // Traverse the FAT table until the target cluster.
-    cluster_t current = file->cluster;
-    size_t nth_cluster = off / (fs->sectors_per_cluster * SECTOR_SIZE);
-    while (nth_cluster > 0) {
-        current = get_next_cluster(fs, current);
-        ASSERT(is_valid_cluster(fs, current));
-        nth_cluster--;
-    }
-
-    offset_t off_in_cluster = off % (fs->sectors_per_cluster * SECTOR_SIZE);
+    size_t cluster_size = fs->sectors_per_cluster * SECTOR_SIZE;
+    size_t allocated = file->num_clusters * cluster_size;
     uint8_t *p = buf;
-    while (true) {
-        offset_t sector_offset = off_in_cluster / SECTOR_SIZE;
-        for (offset_t i = sector_offset; i < fs->sectors_per_cluster; i++) {
+    while (len > 0) {
+        if (off >= allocated) {
+            // The data is not yet written to the disk.
+            memcpy(p, &file->delayed[off - allocated], len);
+            break;
+        }
+
+        // Clusters in an extent are contiguous on the disk: read them at once.
+        struct fat_extent *extent = find_extent(file, off / cluster_size);
+        ASSERT(extent);
+        offset_t extent_off = extent->index * cluster_size;
+        size_t extent_len = extent->num_clusters * cluster_size;
+        offset_t lba =
+            cluster2lba(fs, extent->cluster) + (off - extent_off) / SECTOR_SIZE;
+        size_t off_in_sector = off % SECTOR_SIZE;
+        size_t read_len = MIN(len, extent_off + extent_len - off);
+        if (off_in_sector || read_len < SECTOR_SIZE) {
             // Use a temporary buffer to support unaligned read operations.
-            uint8_t buf[SECTOR_SIZE];
-            fs->blk_read(cluster2lba(fs, current) + i, buf, 1);
-            memcpy(p, &buf[off_in_cluster], MIN(len, SECTOR_SIZE));
+            uint8_t tmp[SECTOR_SIZE];
+            read_len = MIN(read_len, SECTOR_SIZE - off_in_sector);
+            fs->blk_read(lba, tmp, 1);
+            memcpy(p, &tmp[off_in_sector], read_len);
+        } else {
+            read_len = ALIGN_DOWN(read_len, SECTOR_SIZE);
+            fs->blk_read(lba, p, read_len / SECTOR_SIZE);
+        }
 
-            if (len <= SECTOR_SIZE) {
-                return OK;
-            }
+        p += read_len;
+        off += read_len;
+        len -= read_len;
+    }
+
+    return OK;
+}
+
+/// Assigns a new version to the modified file.
+static void bump_version(struct fat *fs, struct fat_file *file) {
+    if (!file->modified) {
+        struct fat_modified *m = malloc(sizeof(*m));
+        m->dirent_lba = file->dirent_lba;
+        m->dirent_index = file->dirent_index;
+        list_push_back(&fs->modified_files, &m->next);
+        file->modified = m;
+    }
 
-            p += SECTOR_SIZE;
-            len -= SECTOR_SIZE;
+    file->modified->version = ++fs->last_version;
+}
+
+/// Returns the version of the file. It changes whenever the file is written,
+/// and is 0 if the file has not been written since mount.
+uint32_t fat_version(struct fat_file *file) {
+    return file->modified ? file->modified->version : 0;
+}
+
+/// Writes data into the file. It can extend the file but can't create a hole:
+/// `off` must not be beyond the end of the file. Data beyond the allocated
+/// clusters is kept in memory until `fat_sync` (or `fat_close`).
+error_t fat_write(struct fat *fs, struct fat_file *file, offset_t off,
+                  const void *buf, size_t len) {
+    if (off > file->size || off + len < off) {
+        return ERR_INVALID_ARG;
+    }
+
+    size_t cluster_size = fs->sectors_per_cluster * SECTOR_SIZE;
+    size_t allocated = file->num_clusters * cluster_size;
+    size_t delayed_len = file->delayed_len;
+    if (off + len > allocated) {
+        delayed_len = MAX(delayed_len, off + len - allocated);
+    }
+
+    // Make sure that we'll be able to allocate clusters for the data.
+    size_t n = count_clusters(fs, delayed_len)
+               - count_clusters(fs, file->delayed_len);
+    if (n > 0 && !reserve_clusters(fs, n)) {
+        return ERR_NO_MEMORY;
+    }
+
+    // Overwrite the allocated clusters in place.
+    const uint8_t *p = buf;
+    if (off < allocated) {
+        size_t write_len = MIN(len, allocated - off);
+        write_clusters(fs, file, off, p, write_len);
+        p += write_len;
+        off += write_len;
+        len -= write_len;
+    }
+
+    // Keep the rest in memory.
+    if (len > 0) {
+        if (delayed_len > file->delayed_capacity) {
+            size_t capacity = MAX(delayed_len, file->delayed_capacity * 2);
+            uint8_t *delayed = malloc(capacity);
+            memcpy(delayed, file->delayed, file->delayed_len);
+            free(file->delayed);
+            file->delayed = delayed;
+            file->delayed_capacity = capacity;
         }
 
-        off_in_cluster = 0;
-        current = get_next_cluster(fs, current);
-        ASSERT(is_valid_cluster(fs, current));
+        memcpy(&file->delayed[off - allocated], p, len);
+        file->delayed_len = delayed_len;
+        off += len;
+    }
+
+    if (off > file->size) {
+        file->size = off;
+        file->dirent_dirty = true;
+    }
+
+    bump_version(fs, file);
+
+    if (file->delayed_len > FAT_DELAYED_MAX) {
+        flush_delayed(fs, file);
+    }
+
+    return OK;
+}
+
+/// Writes modified data, directory entries, and the FAT table into the block
+/// device (through `blk_write`). The FAT table is updated only here: the
+/// entries modified since the last sync are written at once.
+void fat_sync(struct fat *fs) {
+    LIST_FOR_EACH (file, &fs->open_files, struct fat_file, next) {
+        sync_file(fs, file);
+    }
+
+    size_t i = 0;
+    while (i < fs->sectors_per_fat) {
+        if (!fs->fat_dirty[i]) {
+            i++;
+            continue;
+        }
+
+        size_t n = 1;
+        while (i + n < fs->sectors_per_fat && fs->fat_dirty[i + n]) {
+            n++;
+        }
+
+        // Update all FAT tables.
+        for (size_t j = 0; j < fs->num_fats; j++) {
+            fs->blk_write(fs->fat_lba + j * fs->sectors_per_fat + i,
+                          (uint8_t *) fs->fat_cache + i * SECTOR_SIZE, n);
+        }
+
+        memset(&fs->fat_dirty[i], 0, sizeof(bool) * n);
+        i += n;
     }
 }
 
 error_t fat_opendir(struct fat *fs, struct fat_dir *dir, const char *path) {
     if (!strcmp(path, "/")) {
-        open_root_dir(fs, dir);
+        open_dir(fs, dir, 0);
         return OK;
     }
 
-    struct fat_dirent *e = lookup(fs, path);
-    if (!e) {
+    struct fat_dentry *d = lookup(fs, path);
+    if (!d) {
         return ERR_NOT_FOUND;
     }
 
-    opendir_from_dirent(fs, dir, e);
+    if (!(d->entry.attr & FAT_ATTR_DIRECTORY)) {
+        return ERR_NOT_ACCEPTABLE;
+    }
+
+    open_dir(fs, dir, get_cluster_from_entry(&d->entry));
     return OK;
 }
 
@@ -287,6 +946,22 @@ struct fat_dirent *fat_readdir(struct fat *fs, struct fat_dir *dir) {
         return NULL;
     }
 
+    if (dir->index == dir->num_entries) {
+        // Read the next cluster. The root directory in FAT16 is not a cluster
+        // chain: `entries` already contains all of its entries.
+        cluster_t next = dir->cluster ? get_next_cluster(fs, dir->cluster) : 0;
+        if (!is_valid_cluster(fs, next)) {
+            dir->index = -1;
+            return NULL;
+        }
+
+        dir->cluster = next;
+        dir->index = 0;
+        dir->base += dir->num_entries;
+        fs->blk_read(cluster2lba(fs, dir->cluster), dir->entries,
+                     fs->sectors_per_cluster);
+    }
+
     struct fat_dirent *e = &dir->entries[dir->index];
     if (!e->name[0]) {
         dir->index = -1;
@@ -294,19 +969,37 @@ struct fat_dirent *fat_readdir(struct fat *fs, struct fat_dir *dir) {
     }
 
     dir->index++;
-    int num_entries =
-        (fs->sectors_per_cluster * SECTOR_SIZE) / sizeof(struct fat_dirent);
-    if (dir->index == num_entries) {
-        // Read the next cluster.
-        dir->cluster = get_next_cluster(fs, dir->cluster);
-        if (dir->cluster) {
-            dir->index = 0;
-            fs->blk_read(cluster2lba(fs, dir->cluster), dir->entries,
-                         fs->sectors_per_cluster);
-        } else {
+    return e;
+}
+
+/// Returns the position of the next entry. Pass it to `fat_seekdir` to resume
+/// reading the directory later.
+offset_t fat_telldir(struct fat_dir *dir) {
+    return dir->base + dir->index;
+}
+
+/// Moves to the `pos`-th entry of a directory just opened by `fat_opendir`.
+/// Skipped clusters are not read: only the cluster chain is followed.
+void fat_seekdir(struct fat *fs, struct fat_dir *dir, offset_t pos) {
+    cluster_t cluster = dir->cluster;
+    offset_t base = dir->base;
+    while (pos >= base + dir->num_entries) {
+        cluster_t next = cluster ? get_next_cluster(fs, cluster) : 0;
+        if (!is_valid_cluster(fs, next)) {
             dir->index = -1;
+            return;
         }
+
+        cluster = next;
+        base += dir->num_entries;
     }
 
-    return e;
+    if (cluster != dir->cluster) {
+        dir->cluster = cluster;
+        fs->blk_read(cluster2lba(fs, dir->cluster), dir->entries,
+                     fs->sectors_per_cluster);
+    }
+
+    dir->base = base;
+    dir->index = pos - base;
 }
@@ -1,10 +1,21 @@
 #ifndef __FAT_H__
 #define __FAT_H__
 
+#include <list.h>
 #include <types.h>
 
 typedef uint32_t cluster_t;
 #define SECTOR_SIZE 512
+/// The number of FAT sectors loaded into the FAT cache at once.
+#define FAT_CACHE_CHUNK_SECTORS 16
+/// The number of buckets in the directory entry cache.
+#define DCACHE_NUM_BUCKETS 64
+/// The maximum number of cached directory entries.
+#define DCACHE_MAX_ENTRIES 256
+/// The maximum amount of data written beyond the allocated clusters of a file
+/// which is kept in memory until the next sync. Clusters for it are allocated
+/// at once when it's written back so that the file gets contiguous clusters.
+#define FAT_DELAYED_MAX (64 * 1024)
 
 enum fat_type {
     FAT16,
@@ -18,26 +29,103 @@ struct fat {
     /// The root directory entries (FAT12/16).
     cluster_t root_dir_lba;
     offset_t data_lba;
+    /// The number of sectors in the file system.
+    size_t num_sectors;
+    size_t sectors_per_fat;
+    /// The number of FAT tables. Each of them is updated on writes.
+    size_t num_fats;
+    /// The number of data clusters. Valid cluster numbers are 2 to
+    /// `num_clusters + 1`.
+    size_t num_clusters;
+    /// The number of entries in the FAT table.
+    size_t num_fat_entries;
+    /// The FAT table cache. It's loaded in chunks on demand.
+    uint16_t *fat_cache;
+    /// Whether each chunk of the FAT table cache is loaded.
+    bool *fat_cache_loaded;
+    /// Whether each sector of the FAT table cache is modified since the last
+    /// sync.
+    bool *fat_dirty;
+    /// The number of free clusters. -1 if it's not yet counted.
+    int num_free_clusters;
+    /// The number of free clusters reserved for delayed allocations.
+    size_t num_reserved_clusters;
+    /// The cluster where the next search for free clusters starts.
+    cluster_t next_free;
+    /// Open files (struct fat_file). A file opened multiple times is shared.
+    list_t open_files;
+    /// The directory entry cache (struct fat_dentry) hashed by the parent
+    /// directory and the name.
+    list_t dentry_buckets[DCACHE_NUM_BUCKETS];
+    /// Cached directory entries ordered from the least recently used one.
+    list_t dentry_lru;
+    size_t num_dentries;
+    /// Files written since mount (struct fat_modified).
+    list_t modified_files;
+    /// The last version assigned to a modified file.
+    uint32_t last_version;
 
     void (*blk_read)(offset_t sector, void *buf, size_t num_sectors);
     void (*blk_write)(offset_t sector, const void *buf, size_t num_sectors);
 };
 
+/// A file written since mount. The version changes on every write so that
+/// clients can tell whether the file has been changed (see `fat_version`).
+struct fat_modified {
+    list_elem_t next;
+    /// The location of the directory entry.
+    offset_t dirent_lba;
+    size_t dirent_index;
+    uint32_t version;
+};
+
+/// Contiguous clusters in a file.
+struct fat_extent {
+    /// The index of the first cluster in the file.
+    size_t index;
+    /// The first cluster.
+    cluster_t cluster;
+    size_t num_clusters;
+};
+
 struct fat_file {
+    list_elem_t next;
+    int ref_count;
+    /// The location of the directory entry.
+    offset_t dirent_lba;
+    size_t dirent_index;
+    /// True if the size or the first cluster is changed since the last sync.
+    bool dirent_dirty;
     /// The beginning of data.
     cluster_t cluster;
     /// The size of the file in bytes.
     size_t size;
+    /// The cluster chain of the file sorted by `index`.
+    struct fat_extent *extents;
+    size_t num_extents;
+    /// The number of clusters allocated to the file.
+    size_t num_clusters;
+    /// Data beyond the allocated clusters (the delayed allocation). It's
+    /// written to the disk on the next sync.
+    uint8_t *delayed;
+    size_t delayed_len;
+    size_t delayed_capacity;
+    /// NULL if the file has not been written since mount.
+    struct fat_modified *modified;
 };
 
 struct fat_dirent;
 struct fat_dir {
-    /// Entries in the current cluster.
+    /// Entries in the current cluster (or the whole root directory).
     struct fat_dirent *entries;
-    /// The current cluster.
+    /// The number of entries in `entries`.
+    int num_entries;
+    /// The current cluster. 0 if it's the root directory.
     cluster_t cluster;
     /// The next entry index in `entires`. -1 if there's no next entry.
     int index;
+    /// The position of `entries[0]` in the directory.
+    offset_t base;
 };
 
 //
@@ -76,6 +164,11 @@ struct bpb {
     uint8_t   magic[2]; // 0x55, 0xaa
 } PACKED;
 
+/// Also set in long file name entries.
+#define FAT_ATTR_VOLUME_ID 0x08
+#define FAT_ATTR_DIRECTORY 0x10
+#define FAT_ATTR_ARCHIVE   0x20
+
 struct fat_dirent {
     // name[0]
     // 0xe5 / 0x00: unused
@@ -95,14 +188,39 @@ struct fat_dirent {
     uint32_t  size;
 } PACKED;
 
+/// A cached result of looking up a name in a directory.
+struct fat_dentry {
+    list_elem_t bucket_next;
+    list_elem_t lru_next;
+    /// The first cluster of the parent directory. 0 if it's the root
+    /// directory.
+    cluster_t parent;
+    char name[9];
+    char ext[4];
+    /// True if the parent directory does not contain the name.
+    bool negative;
+    struct fat_dirent entry;
+    /// The location of the entry.
+    offset_t lba;
+    size_t index;
+};
+
 error_t fat_probe(struct fat *fs,
                   void (*blk_read)(offset_t sector, void *buf, size_t num_sectors),
                   void (*blk_write)(offset_t sector, const void *buf, size_t num_sectors));
-error_t fat_open(struct fat *fs, struct fat_file *file, const char *path);
+error_t fat_open(struct fat *fs, const char *path, struct fat_file **file);
+error_t fat_create(struct fat *fs, const char *path);
+void fat_close(struct fat *fs, struct fat_file *file);
 error_t fat_read(struct fat *fs, struct fat_file *file, offset_t off, void *buf,
                  size_t len);
+error_t fat_write(struct fat *fs, struct fat_file *file, offset_t off,
+                  const void *buf, size_t len);
+uint32_t fat_version(struct fat_file *file);
+void fat_sync(struct fat *fs);
 error_t fat_opendir(struct fat *fs, struct fat_dir *dir, const char *path);
 void fat_closedir(struct fat *fs, struct fat_dir *dir);
 struct fat_dirent *fat_readdir(struct fat *fs, struct fat_dir *dir);
+offset_t fat_telldir(struct fat_dir *dir);
+void fat_seekdir(struct fat *fs, struct fat_dir *dir, offset_t pos);
 
 #endif
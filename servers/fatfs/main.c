@@ -1,44 +1,368 @@
 #include <std/printf.h>
 #include <std/syscall.h>
+#include <std/io.h>
 #include <std/lookup.h>
 #include <std/malloc.h>
 #include <std/map.h>
 #include <std/string.h>
 #include <std/rand.h>
+#include <blk_queue.h>
 #include <message.h>
 #include <cstring.h>
+#include "bcache.h"
 #include "fat.h"
 
-static task_t ramdisk_server;
+/// The maximum number of sectors in a BLK_READ_MSG or BLK_WRITE_MSG (limited by
+/// the size of the bulk buffer).
+#define BLK_MSG_MAX_SECTORS (8192 / SECTOR_SIZE)
+/// The maximum amount of memory used by the block cache.
+#define BCACHE_BUDGET (2 * 1024 * 1024)
+/// The number of data buffers in the asynchronous I/O queue. Each buffer holds
+/// a cache block.
+#define QUEUE_NUM_SLOTS 32
+/// Modified data is written back to the disk within this interval (in
+/// milliseconds).
+#define FLUSH_INTERVAL 3000
+/// The maximum number of entries in a FS_READDIR_REPLY_MSG.
+#define READDIR_MAX_ENTRIES (8192 / sizeof(struct fs_dirent))
+
+/// An in-flight asynchronous read. Indexed by the tag.
+struct pending_read {
+    bool in_use;
+    offset_t block;
+    size_t num_blocks;
+    unsigned slots[BLK_SG_MAX];
+    /// A bitmap of blocks written to the disk while the read is in flight.
+    /// Their data might be older than the written one.
+    uint32_t stale;
+};
+
+/// A buffer shared by a client for FS_READ_BUFFER_MSG.
+struct client_buffer {
+    list_elem_t next;
+    task_t client;
+    uint8_t *ptr;
+    size_t len;
+};
+
+static task_t blk_server;
 static map_t clients;
+static list_t client_buffers;
+/// The disk image mapped by the block device server (read-only). NULL if it's not available.
+static uint8_t *image = NULL;
+static size_t image_num_sectors = 0;
+/// A bitmap of sectors written since mount. The mapped image does not reflect
+/// writes: ramdisk gets a private copy of the written page.
+static uint8_t *written = NULL;
+/// True if the timer to write back modified data is set.
+static bool flush_timer_set = false;
+/// The asynchronous I/O queue shared with the block device server. NULL if it's not available.
+static struct blk_queue *queue = NULL;
+static uint8_t *queue_data;
+static uint32_t free_slots = 0xffffffff;
+static struct pending_read pending_reads[BLK_QUEUE_DEPTH];
+STATIC_ASSERT(QUEUE_NUM_SLOTS <= 32 && BCACHE_BLOCK_SIZE == PAGE_SIZE);
+
+/// Submits a readahead request into the asynchronous I/O queue.
+static bool async_read(offset_t block, size_t num_blocks) {
+    if (!queue || num_blocks > BLK_SG_MAX
+        || __builtin_popcount(free_slots) < (int) num_blocks
+        || queue->sq_tail - queue->sq_head == BLK_QUEUE_DEPTH) {
+        return false;
+    }
+
+    uint32_t tag;
+    for (tag = 0; tag < BLK_QUEUE_DEPTH; tag++) {
+        if (!pending_reads[tag].in_use) {
+            break;
+        }
+    }
+
+    if (tag == BLK_QUEUE_DEPTH) {
+        return false;
+    }
+
+    struct pending_read *pending = &pending_reads[tag];
+    struct blk_request *req = &queue->sq[queue->sq_tail % BLK_QUEUE_DEPTH];
+    pending->in_use = true;
+    pending->block = block;
+    pending->num_blocks = num_blocks;
+    pending->stale = 0;
+    req->tag = tag;
+    req->op = BLK_OP_READ;
+    req->num_sg = num_blocks;
+    req->sector = block * BCACHE_BLOCK_SECTORS;
+    for (size_t i = 0; i < num_blocks; i++) {
+        // The buffers don't have to be contiguous.
+        unsigned slot = __builtin_ctz(free_slots);
+        free_slots &= ~(1u << slot);
+        pending->slots[i] = slot;
+        req->sg[i].offset = slot * BCACHE_BLOCK_SIZE;
+        req->sg[i].len = BCACHE_BLOCK_SIZE;
+    }
 
-void blk_read(size_t sector, void *buf, size_t num_sectors) {
+    memory_barrier();
+    queue->sq_tail++;
+    ipc_notify(blk_server, NOTIFY_NEW_DATA);
+    return true;
+}
+
+/// Passes completed asynchronous reads to the block cache.
+static void handle_completions(void) {
+    while (queue->cq_head != queue->cq_tail) {
+        memory_barrier();
+        struct blk_completion *c = &queue->cq[queue->cq_head % BLK_QUEUE_DEPTH];
+        ASSERT(c->tag < BLK_QUEUE_DEPTH);
+        struct pending_read *pending = &pending_reads[c->tag];
+        for (size_t i = 0; i < pending->num_blocks; i++) {
+            bool valid = IS_OK(c->status) && !(pending->stale & (1u << i));
+            uint8_t *data = &queue_data[pending->slots[i] * BCACHE_BLOCK_SIZE];
+            bcache_insert(pending->block + i, valid ? data : NULL);
+            free_slots |= 1u << pending->slots[i];
+        }
+
+        pending->in_use = false;
+        queue->cq_head++;
+    }
+}
+
+/// Sets up the asynchronous I/O queue with the block device server.
+static error_t attach_queue(void) {
+    size_t num_pages = 1 + QUEUE_NUM_SLOTS;
+    paddr_t paddr;
+    uint8_t *pages = io_alloc_pages(num_pages, 0, &paddr);
+    memset(pages, 0, PAGE_SIZE);
+
+    // Share the pages with the block device server.
     struct message m;
-    m.type = BLK_READ_MSG;
-    m.blk_read.sector = sector;
-    m.blk_read.num_sectors = num_sectors;
-    error_t err = ipc_call(ramdisk_server, &m);
-    ASSERT(IS_OK(err));
-    ASSERT(m.type == BLK_READ_REPLY_MSG);
-    memcpy(buf, m.blk_read_reply.data, m.blk_read_reply.len);
+    m.type = GRANT_PAGES_MSG;
+    m.grant_pages.task = blk_server;
+    m.grant_pages.vaddr = (vaddr_t) pages;
+    m.grant_pages.num_pages = num_pages;
+    m.grant_pages.writable = true;
+    error_t err = ipc_call(INIT_TASK_TID, &m);
+    if (IS_ERROR(err)) {
+        return err;
+    }
+
+    ASSERT(m.type == GRANT_PAGES_REPLY_MSG);
+    vaddr_t server_vaddr = m.grant_pages_reply.vaddr;
+    m.type = BLK_ATTACH_QUEUE_MSG;
+    m.blk_attach_queue.vaddr = server_vaddr;
+    m.blk_attach_queue.num_pages = num_pages;
+    err = ipc_call(blk_server, &m);
+    if (IS_ERROR(err)) {
+        return err;
+    }
+
+    queue = (struct blk_queue *) pages;
+    queue_data = &pages[PAGE_SIZE];
+    return OK;
+}
+
+static bool is_written(offset_t sector, size_t num_sectors) {
+    for (offset_t i = sector; i < sector + num_sectors; i++) {
+        if (written[i / 8] & (1 << (i % 8))) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void blk_read(offset_t sector, void *buf, size_t num_sectors) {
+    if (image && sector + num_sectors <= image_num_sectors
+        && !is_written(sector, num_sectors)) {
+        // Fast path: read directly from the mapped image.
+        memcpy(buf, &image[sector * SECTOR_SIZE], num_sectors * SECTOR_SIZE);
+        return;
+    }
+
+    uint8_t *p = buf;
+    while (num_sectors > 0) {
+        size_t n = MIN(num_sectors, BLK_MSG_MAX_SECTORS);
+        struct message m;
+        m.type = BLK_READ_MSG;
+        m.blk_read.sector = sector;
+        m.blk_read.num_sectors = n;
+        error_t err = ipc_call(blk_server, &m);
+        ASSERT(IS_OK(err));
+        ASSERT(m.type == BLK_READ_REPLY_MSG);
+        memcpy(p, m.blk_read_reply.data, m.blk_read_reply.len);
+        free(m.blk_read_reply.data);
+
+        p += n * SECTOR_SIZE;
+        sector += n;
+        num_sectors -= n;
+    }
+}
+
+/// Marks blocks in in-flight reads overlapping with the written sectors as
+/// stale. Otherwise, a block written back and evicted could be brought back
+/// with the old data.
+static void invalidate_pending_reads(offset_t sector, size_t num_sectors) {
+    for (int tag = 0; tag < BLK_QUEUE_DEPTH; tag++) {
+        struct pending_read *pending = &pending_reads[tag];
+        if (!pending->in_use) {
+            continue;
+        }
+
+        for (size_t i = 0; i < pending->num_blocks; i++) {
+            offset_t first = (pending->block + i) * BCACHE_BLOCK_SECTORS;
+            if (first < sector + num_sectors
+                && sector < first + BCACHE_BLOCK_SECTORS) {
+                pending->stale |= 1u << i;
+            }
+        }
+    }
+}
+
+void blk_write(offset_t sector, const void *buf, size_t num_sectors) {
+    invalidate_pending_reads(sector, num_sectors);
+    if (image) {
+        for (offset_t i = sector;
+             i < sector + num_sectors && i < image_num_sectors; i++) {
+            written[i / 8] |= 1 << (i % 8);
+        }
+    }
+
+    const uint8_t *p = buf;
+    while (num_sectors > 0) {
+        size_t n = MIN(num_sectors, BLK_MSG_MAX_SECTORS);
+        struct message m;
+        m.type = BLK_WRITE_MSG;
+        m.blk_write.sector = sector;
+        m.blk_write.data = (uint8_t *) p;
+        m.blk_write.len = n * SECTOR_SIZE;
+        error_t err = ipc_call(blk_server, &m);
+        ASSERT(IS_OK(err));
+        ASSERT(m.type == BLK_WRITE_REPLY_MSG);
+
+        p += n * SECTOR_SIZE;
+        sector += n;
+        num_sectors -= n;
+    }
 }
 
-void blk_write(size_t offset, const void *buf, size_t len) {
-    PANIC("NYI");
+/// Writes back modified data later.
+static void schedule_flush(void) {
+    if (!flush_timer_set) {
+        error_t err = timer_set(FLUSH_INTERVAL);
+        ASSERT_OK(err);
+        flush_timer_set = true;
+    }
+}
+
+static void flush(struct fat *fs) {
+    fat_sync(fs);
+    bcache_flush();
+}
+
+static struct client_buffer *get_client_buffer(task_t client) {
+    LIST_FOR_EACH (buffer, &client_buffers, struct client_buffer, next) {
+        if (buffer->client == client) {
+            return buffer;
+        }
+    }
+
+    return NULL;
+}
+
+/// Returns true if the path received in a bulk buffer is null-terminated.
+static bool is_valid_path(const char *path, size_t len) {
+    return len > 0 && path[len - 1] == '\0';
+}
+
+/// Converts an on-disk directory entry into the one in FS_READDIR_REPLY_MSG.
+static void fill_dirent(struct fs_dirent *d, struct fat_dirent *e) {
+    char *p = d->name;
+    for (int i = 0; i < 8 && e->name[i] != ' '; i++) {
+        // 0x05 at the beginning stands for 0xe5.
+        *p++ = (i == 0 && e->name[i] == 0x05) ? 0xe5 : e->name[i];
+    }
+
+    if (e->ext[0] != ' ') {
+        *p++ = '.';
+        for (int i = 0; i < 3 && e->ext[i] != ' '; i++) {
+            *p++ = e->ext[i];
+        }
+    }
+
+    *p = '\0';
+    d->attr = e->attr;
+    d->reserved = 0;
+    d->size = e->size;
+    d->cluster = (e->cluster_begin_high << 16) | e->cluster_begin_low;
+}
+
+/// Lists entries in the directory from `*cookie` into `entries` and updates
+/// `*cookie` to the position of the next entry.
+static error_t read_dir(struct fat *fs, const char *path, offset_t *cookie,
+                        struct fs_dirent *entries, size_t *num_entries,
+                        bool *end) {
+    struct fat_dir dir;
+    error_t err = fat_opendir(fs, &dir, path);
+    if (IS_ERROR(err)) {
+        return err;
+    }
+
+    fat_seekdir(fs, &dir, *cookie);
+    size_t n = 0;
+    *end = false;
+    while (n < READDIR_MAX_ENTRIES) {
+        struct fat_dirent *e = fat_readdir(fs, &dir);
+        if (!e) {
+            *end = true;
+            break;
+        }
+
+        // Skip unused entries, long file name entries, and the volume label.
+        if (e->name[0] == 0xe5 || (e->attr & FAT_ATTR_VOLUME_ID)) {
+            continue;
+        }
+
+        fill_dirent(&entries[n++], e);
+    }
+
+    *cookie = fat_telldir(&dir);
+    *num_entries = n;
+    fat_closedir(fs, &dir);
+    return OK;
 }
 
 void main(void) {
     TRACE("starting...");
     clients = map_new();
+    list_init(&client_buffers);
+
+    blk_server = ipc_lookup(BLK_SERVER);
+    ASSERT_OK(blk_server);
+
+    bcache_init(blk_read, blk_write, BCACHE_BUDGET);
 
-    ramdisk_server = ipc_lookup("ramdisk");
-    ASSERT_OK(ramdisk_server);
+    // Try mapping the disk image to avoid IPC on every read. If it's not
+    // supported, fall back to BLK_READ_MSG and read ahead through the
+    // asynchronous I/O queue.
+    struct message m;
+    m.type = BLK_MAP_MSG;
+    if (IS_OK(ipc_call(blk_server, &m)) && m.type == BLK_MAP_REPLY_MSG) {
+        image = (uint8_t *) m.blk_map_reply.vaddr;
+        image_num_sectors = m.blk_map_reply.num_sectors;
+        size_t bitmap_size = ALIGN_UP(image_num_sectors, 8) / 8;
+        written = malloc(bitmap_size);
+        memset(written, 0, bitmap_size);
+    } else if (IS_OK(attach_queue())) {
+        // Read ahead in background.
+        bcache_set_async_read(async_read, handle_completions);
+    }
 
     struct fat fs;
-    if (IS_ERROR(fat_probe(&fs, blk_read, blk_write))) {
+    if (IS_ERROR(fat_probe(&fs, bcache_read, bcache_write))) {
         PANIC("failed to locate a FAT file system");
     }
 
+    bcache_set_num_sectors(fs.num_sectors);
+
     DBG("Files ---------------------------------------------");
     struct fat_dir dir;
     struct fat_dirent *e;
@@ -48,12 +372,16 @@ void main(void) {
         strncpy(tmp, (const char *) e->name, sizeof(tmp));
         DBG("/%s", tmp);
     }
+    fat_closedir(&fs, &dir);
     ASSERT_OK(fat_opendir(&fs, &dir, "/apps"));
     while ((e = fat_readdir(&fs, &dir)) != NULL) {
         strncpy(tmp, (const char *) e->name, sizeof(tmp));
         DBG("/APPS/%s", tmp);
     }
+    fat_closedir(&fs, &dir);
     DBG("---------------------------------------------------");
+    DBG("block cache: %d hits, %d misses", bcache_stats()->hits,
+        bcache_stats()->misses);
 
     TRACE("ready");
     while (true) {
@@ -62,13 +390,27 @@ void main(void) {
         ASSERT_OK(err);
 
         switch (m.type) {
+            case NOTIFICATIONS_MSG:
+                if ((m.notifications.data & NOTIFY_NEW_DATA) && queue) {
+                    handle_completions();
+                }
+
+                if (m.notifications.data & NOTIFY_TIMER) {
+                    flush_timer_set = false;
+                    flush(&fs);
+                }
+                break;
             case FS_OPEN_MSG: {
-                struct fat_file *file = malloc(sizeof(*file));
-                // TODO: Ensure path is null-terminated.
+                if (!is_valid_path(m.fs_open.path, m.fs_open.len)) {
+                    ipc_reply_err(m.src, ERR_INVALID_ARG);
+                    free(m.fs_open.path);
+                    break;
+                }
 
-                error_t err = fat_open(&fs, file, m.fs_open.path);
+                struct fat_file *file;
+                error_t err = fat_open(&fs, m.fs_open.path, &file);
+                free(m.fs_open.path);
                 if (IS_ERROR(err)) {
-                    free(file);
                     ipc_reply_err(m.src, err);
                     break;
                 }
@@ -82,6 +424,19 @@ void main(void) {
                 ipc_reply(m.src, &m);
                 break;
             }
+            case FS_CLOSE_MSG: {
+                struct fat_file *file =
+                    map_remove_handle(clients, &m.fs_close.handle);
+                if (!file) {
+                    ipc_reply_err(m.src, ERR_NOT_FOUND);
+                    break;
+                }
+
+                fat_close(&fs, file);
+                m.type = FS_CLOSE_REPLY_MSG;
+                ipc_reply(m.src, &m);
+                break;
+            }
             case FS_READ_MSG: {
                 struct fat_file *file =
                     map_get_handle(clients, &m.fs_read.handle);
@@ -90,22 +445,182 @@ void main(void) {
                     break;
                 }
 
-                size_t max_len = MIN(8192, m.fs_read.len);
+                if (m.fs_read.offset > file->size) {
+                    ipc_reply_err(m.src, ERR_TOO_LARGE);
+                    break;
+                }
+
+                // Don't read beyond the end of file: the reply could be
+                // shorter than the requested length.
+                size_t max_len = MIN(MIN(8192, m.fs_read.len),
+                                     file->size - m.fs_read.offset);
                 void *buf = malloc(max_len);
                 error_t err =
-                    fat_read(&fs, file, m.fs_read.offset, buf, m.fs_read.len);
+                    fat_read(&fs, file, m.fs_read.offset, buf, max_len);
                 if (IS_ERROR(err)) {
                     ipc_reply_err(m.src, err);
+                    free(buf);
                     break;
                 }
 
                 m.type = FS_READ_REPLY_MSG;
                 m.fs_read_reply.data = buf;
-                m.fs_read_reply.len = m.fs_read.len;
+                m.fs_read_reply.len = max_len;
                 ipc_reply(m.src, &m);
                 free(buf);
                 break;
             }
+            case FS_STAT_MSG: {
+                struct fat_file *file =
+                    map_get_handle(clients, &m.fs_stat.handle);
+                if (!file) {
+                    ipc_reply_err(m.src, ERR_NOT_FOUND);
+                    break;
+                }
+
+                m.type = FS_STAT_REPLY_MSG;
+                m.fs_stat_reply.size = file->size;
+                m.fs_stat_reply.version = fat_version(file);
+                ipc_reply(m.src, &m);
+                break;
+            }
+            case FS_ATTACH_BUFFER_MSG: {
+                // We write file data into the buffer: make sure that it's
+                // granted by the client.
+                error_t err =
+                    io_verify_grant(m.src, m.fs_attach_buffer.vaddr,
+                                    m.fs_attach_buffer.num_pages, true);
+                if (IS_ERROR(err)) {
+                    ipc_reply_err(m.src, err);
+                    break;
+                }
+
+                // The pages are mapped on demand. Since we can't unmap pages,
+                // the previous buffer is just forgotten.
+                struct client_buffer *buffer = get_client_buffer(m.src);
+                if (!buffer) {
+                    buffer = malloc(sizeof(*buffer));
+                    buffer->client = m.src;
+                    list_push_back(&client_buffers, &buffer->next);
+                }
+
+                buffer->ptr = (uint8_t *) m.fs_attach_buffer.vaddr;
+                buffer->len = m.fs_attach_buffer.num_pages * PAGE_SIZE;
+                m.type = FS_ATTACH_BUFFER_REPLY_MSG;
+                ipc_reply(m.src, &m);
+                break;
+            }
+            case FS_READ_BUFFER_MSG: {
+                struct fat_file *file =
+                    map_get_handle(clients, &m.fs_read_buffer.handle);
+                struct client_buffer *buffer = get_client_buffer(m.src);
+                if (!file || !buffer) {
+                    ipc_reply_err(m.src, ERR_NOT_FOUND);
+                    break;
+                }
+
+                offset_t offset = m.fs_read_buffer.offset;
+                size_t buffer_offset = m.fs_read_buffer.buffer_offset;
+                if (offset > file->size || buffer_offset > buffer->len
+                    || m.fs_read_buffer.len > buffer->len - buffer_offset) {
+                    ipc_reply_err(m.src, ERR_TOO_LARGE);
+                    break;
+                }
+
+                // Read into the client's buffer directly.
+                size_t len = MIN(m.fs_read_buffer.len, file->size - offset);
+                error_t err = fat_read(&fs, file, offset,
+                                       &buffer->ptr[buffer_offset], len);
+                if (IS_ERROR(err)) {
+                    ipc_reply_err(m.src, err);
+                    break;
+                }
+
+                m.type = FS_READ_BUFFER_REPLY_MSG;
+                m.fs_read_buffer_reply.len = len;
+                ipc_reply(m.src, &m);
+                break;
+            }
+            case FS_WRITE_MSG: {
+                struct fat_file *file =
+                    map_get_handle(clients, &m.fs_write.handle);
+                if (!file) {
+                    ipc_reply_err(m.src, ERR_NOT_FOUND);
+                    free(m.fs_write.data);
+                    break;
+                }
+
+                error_t err = fat_write(&fs, file, m.fs_write.offset,
+                                        m.fs_write.data, m.fs_write.len);
+                free(m.fs_write.data);
+                if (IS_ERROR(err)) {
+                    ipc_reply_err(m.src, err);
+                    break;
+                }
+
+                schedule_flush();
+                m.type = FS_WRITE_REPLY_MSG;
+                ipc_reply(m.src, &m);
+                break;
+            }
+            case FS_SYNC_MSG:
+                flush(&fs);
+                m.type = FS_SYNC_REPLY_MSG;
+                ipc_reply(m.src, &m);
+                break;
+            case FS_CREATE_MSG: {
+                if (!is_valid_path(m.fs_create.path, m.fs_create.len)) {
+                    ipc_reply_err(m.src, ERR_INVALID_ARG);
+                    free(m.fs_create.path);
+                    break;
+                }
+
+                error_t err = fat_create(&fs, m.fs_create.path);
+                free(m.fs_create.path);
+                if (IS_ERROR(err)) {
+                    ipc_reply_err(m.src, err);
+                    break;
+                }
+
+                schedule_flush();
+                m.type = FS_CREATE_REPLY_MSG;
+                ipc_reply(m.src, &m);
+                break;
+            }
+            case FS_READDIR_MSG: {
+                if (!is_valid_path(m.fs_readdir.path, m.fs_readdir.len)) {
+                    ipc_reply_err(m.src, ERR_INVALID_ARG);
+                    free(m.fs_readdir.path);
+                    break;
+                }
+
+                offset_t cookie = m.fs_readdir.cookie;
+                size_t num_entries;
+                bool end;
+                struct fs_dirent *entries =
+                    malloc(sizeof(*entries) * READDIR_MAX_ENTRIES);
+                error_t err = read_dir(&fs, m.fs_readdir.path, &cookie, entries,
+                                       &num_entries, &end);
+                free(m.fs_readdir.path);
+                if (IS_OK(err) && !num_entries) {
+                    err = ERR_END;
+                }
+
+                if (IS_ERROR(err)) {
+                    ipc_reply_err(m.src, err);
+                    free(entries);
+                    break;
+                }
+
+                m.type = FS_READDIR_REPLY_MSG;
+                m.fs_readdir_reply.entries = entries;
+                m.fs_readdir_reply.len = sizeof(*entries) * num_entries;
+                m.fs_readdir_reply.next_cookie = cookie;
+                m.fs_readdir_reply.end = end;
+                ipc_reply(m.src, &m);
+                free(entries);
+                break;
+            }
             default:
                 TRACE("unknown message %d", m.type);
         }
@@ -2,6 +2,7 @@
 #include <message.h>
 #include <std/malloc.h>
 #include <std/printf.h>
+#include <std/regions.h>
 #include <std/syscall.h>
 #include <cstring.h>
 #include "elf.h"
@@ -15,12 +16,63 @@ extern char __free_vaddr_end[];
 
 /// The maximum size of bss + stack + heap.
 #define ZEROED_PAGES_SIZE (64 * 1024 * 1024)
+/// The interval and the number of pages to refill the pre-zeroed pages pool.
+#define ZEROED_POOL_REFILL_INTERVAL 10
+#define ZEROED_POOL_REFILL_BATCH    16
 
-struct page_area {
-    list_elem_t next;
+/// Physical pages filled with the contents of an initfs file. Tasks launched
+/// from the same file share them instead of having their own copies.
+struct file_cache {
+    struct initfs_file *file;
+    /// Indexed by the page offset in the file. 0 if it's not yet filled.
+    paddr_t *pages;
+    size_t num_pages;
+};
+
+#define OWNED_PAGES_PER_CHUNK 64
+
+/// A page mapped in a task.
+struct owned_page {
+    /// The page-aligned address where the page is mapped in the task.
     vaddr_t vaddr;
     paddr_t paddr;
+};
+
+/// A chunk of a pages list of a task.
+struct owned_pages {
+    list_elem_t next;
     size_t num_pages;
+    struct owned_page pages[OWNED_PAGES_PER_CHUNK];
+};
+
+enum region_type {
+    /// Physically contiguous pages allocated by ALLOC_PAGES_MSG.
+    REGION_PAGE_AREA,
+    /// A loadable ELF segment.
+    REGION_SEGMENT,
+    /// Zero-filled pages (.bss section, stack, and heap).
+    REGION_ZEROED,
+    /// Read-only pages shared by another task (GRANT_PAGES_MSG).
+    REGION_GRANT,
+};
+
+/// A virtual memory region `[start, end)` of a task.
+struct region {
+    REGION_FIELDS
+    enum region_type type;
+    union {
+        /// The physical address of `start` (REGION_PAGE_AREA).
+        paddr_t paddr;
+        /// The program header (REGION_SEGMENT).
+        struct elf64_phdr *phdr;
+        /// The task and its address which correspond to `start`
+        /// (REGION_GRANT).
+        struct {
+            task_t task;
+            vaddr_t vaddr;
+            bool writable;
+        } grant;
+    };
 };
 
 /// Task Control Block (TCB).
@@ -29,14 +81,30 @@ struct task {
     task_t tid;
     char name[32];
     struct initfs_file *file;
+    struct file_cache *cache;
     void *file_header;
     struct elf64_ehdr *ehdr;
     struct elf64_phdr *phdrs;
     vaddr_t free_vaddr;
-    list_t page_areas;
+    /// Page areas, ELF segments, and the zeroed pages.
+    struct region_map regions;
+    /// Pages allocated by the pager for the task (struct owned_pages). Pages
+    /// shared through `cache` are not included.
+    list_t owned_pages;
+    /// The ranges of the task's address space granted to other tasks
+    /// (struct region_header), and the pages in them mapped through the grants
+    /// or by the task itself (struct owned_pages). The task's own faults on
+    /// them must map the same pages.
+    struct region_map lent_ranges;
+    list_t lent_pages;
 };
 
 static struct task tasks[TASKS_MAX];
+static struct file_cache *file_caches;
+/// The zero-filled page shared by all tasks. It's never freed.
+static paddr_t zero_page;
+/// Whether the timer to refill the pre-zeroed pages pool is set.
+static bool refill_timer_set = false;
 
 /// Look for the task in the our task table.
 static struct task *get_task_by_tid(task_t tid) {
@@ -55,7 +123,8 @@ static void read_file(struct initfs_file *file, offset_t off, void *buf, size_t
     memcpy(buf, p, len);
 }
 
-static task_t launch_server(struct initfs_file *file) {
+static task_t launch_server(struct file_cache *cache) {
+    struct initfs_file *file = cache->file;
     INFO("launching %s...", file->name);
 
     // Look for an unused task ID.
@@ -88,17 +157,149 @@ static task_t launch_server(struct initfs_file *file) {
 
     task->in_use = true;
     task->file = file;
+    task->cache = cache;
     task->file_header = file_header;
     task->ehdr = ehdr;
     task->phdrs = (struct elf64_phdr *) ((uintptr_t) ehdr + ehdr->e_ehsize);
     task->free_vaddr = (vaddr_t) __free_vaddr;
     strncpy(task->name, file->name, sizeof(task->name));
-    list_init(&task->page_areas);
+    list_init(&task->owned_pages);
+    regions_init(&task->lent_ranges, sizeof(struct region_header));
+    list_init(&task->lent_pages);
+
+    regions_init(&task->regions, sizeof(struct region));
+    struct region zeroed;
+    zeroed.start = (vaddr_t) __zeroed_pages;
+    zeroed.end = zeroed.start + ZEROED_PAGES_SIZE;
+    zeroed.type = REGION_ZEROED;
+    regions_add(&task->regions, &zeroed);
+    for (unsigned i = 0; i < ehdr->e_phnum; i++) {
+        struct elf64_phdr *phdr = &task->phdrs[i];
+        if (phdr->p_type != PT_LOAD || !phdr->p_memsz) {
+            continue;
+        }
+
+        struct region segment;
+        segment.start = phdr->p_vaddr;
+        segment.end = phdr->p_vaddr + phdr->p_memsz;
+        segment.type = REGION_SEGMENT;
+        segment.phdr = phdr;
+        regions_add(&task->regions, &segment);
+    }
+
     return task->tid;
 }
 
-static paddr_t pager(struct task *task, vaddr_t vaddr, pagefault_t fault) {
-    if (fault & PF_PRESENT) {
+/// Appends the page mapped at `vaddr` to the pages list.
+static void add_page(list_t *pages, vaddr_t vaddr, paddr_t paddr) {
+    struct owned_pages *chunk = NULL;
+    if (!list_is_empty(pages)) {
+        chunk = LIST_CONTAINER(pages->prev, struct owned_pages, next);
+    }
+
+    if (!chunk || chunk->num_pages == OWNED_PAGES_PER_CHUNK) {
+        chunk = malloc(sizeof(*chunk));
+        chunk->num_pages = 0;
+        list_push_back(pages, &chunk->next);
+    }
+
+    struct owned_page *page = &chunk->pages[chunk->num_pages++];
+    page->vaddr = ALIGN_DOWN(vaddr, PAGE_SIZE);
+    page->paddr = paddr;
+}
+
+/// Returns the page mapped at `vaddr` in the pages list or 0 if there's no
+/// such page.
+static paddr_t find_page(list_t *pages, vaddr_t vaddr) {
+    vaddr = ALIGN_DOWN(vaddr, PAGE_SIZE);
+    LIST_FOR_EACH (chunk, pages, struct owned_pages, next) {
+        for (size_t i = 0; i < chunk->num_pages; i++) {
+            if (chunk->pages[i].vaddr == vaddr) {
+                return chunk->pages[i].paddr;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/// Frees the pages list. It doesn't free the pages themselves.
+static void free_pages_list(list_t *pages) {
+    LIST_FOR_EACH (chunk, pages, struct owned_pages, next) {
+        list_remove(&chunk->next);
+        free(chunk);
+    }
+}
+
+/// Records the page mapped at `vaddr` in a granted range. It replaces the
+/// previous one, e.g. a page copied on write.
+static void lend_page(struct task *task, vaddr_t vaddr, paddr_t paddr) {
+    vaddr = ALIGN_DOWN(vaddr, PAGE_SIZE);
+    LIST_FOR_EACH (chunk, &task->lent_pages, struct owned_pages, next) {
+        for (size_t i = 0; i < chunk->num_pages; i++) {
+            if (chunk->pages[i].vaddr == vaddr) {
+                chunk->pages[i].paddr = paddr;
+                return;
+            }
+        }
+    }
+
+    add_page(&task->lent_pages, vaddr, paddr);
+}
+
+/// Makes the task own the allocated page mapped at `vaddr`. It's freed when the
+/// task is killed.
+static paddr_t own_page(struct task *task, vaddr_t vaddr, paddr_t paddr) {
+    add_page(&task->owned_pages, vaddr, paddr);
+    if (task->lent_ranges.num_regions) {
+        struct region_header *range = regions_lookup(&task->lent_ranges, vaddr);
+        if (range && range->start <= vaddr) {
+            lend_page(task, vaddr, paddr);
+        }
+    }
+
+    return paddr;
+}
+
+/// Fills a page with the file contents at `offset`. The part beyond the end of
+/// file is filled with zeros.
+static void fill_page(struct initfs_file *file, offset_t offset, paddr_t paddr) {
+    size_t len = (offset < file->len) ? MIN(PAGE_SIZE, file->len - offset) : 0;
+    read_file(file, offset, (void *) paddr, len);
+    memset((void *) (paddr + len), 0, PAGE_SIZE - len);
+}
+
+/// Returns a physical page filled with the file contents at `offset`. The page
+/// is shared among tasks: map it as read-only.
+static paddr_t get_cached_page(struct file_cache *cache, offset_t offset) {
+    size_t index = offset / PAGE_SIZE;
+    DEBUG_ASSERT(index < cache->num_pages);
+    if (!cache->pages[index]) {
+        paddr_t paddr = pages_alloc(1);
+        fill_page(cache->file, offset, paddr);
+        cache->pages[index] = paddr;
+    }
+
+    return cache->pages[index];
+}
+
+/// Resolves a page fault in ELF segments. `region` is the first segment
+/// overlapping with the page.
+static paddr_t segment_pager(struct task *task, struct region *region,
+                             vaddr_t vaddr, pagefault_t fault,
+                             pageattrs_t *attrs) {
+    // A page could be shared by multiple segments: it's writable if any of
+    // them is writable.
+    struct elf64_phdr *phdr = region->phdr;
+    bool writable = false;
+    for (struct region *r = region; r && r->start < vaddr + PAGE_SIZE;
+         r = regions_next(&task->regions, r)) {
+        if (r->type == REGION_SEGMENT) {
+            writable |= (r->phdr->p_flags & PF_W) != 0;
+        }
+    }
+
+    if ((fault & PF_PRESENT) && (!(fault & PF_WRITE) || !writable)) {
         // Invalid access. For instance the user thread has tried to write to
         // readonly area.
         WARN("%s: invalid memory access at %p (perhaps segfault?)", task->name,
@@ -106,54 +307,157 @@ static paddr_t pager(struct task *task, vaddr_t vaddr, pagefault_t fault) {
         return 0;
     }
 
-    LIST_FOR_EACH (area, &task->page_areas, struct page_area, next) {
-        if (area->vaddr <= vaddr
-            && vaddr < area->vaddr + area->num_pages * PAGE_SIZE) {
-            return area->paddr + (vaddr - area->vaddr);
+    // Pages at page-aligned file offsets are shared among the tasks launched
+    // from the same file.
+    offset_t offset = (vaddr - phdr->p_vaddr) + phdr->p_offset;
+    bool shareable =
+        IS_ALIGNED(offset, PAGE_SIZE) && offset < task->file->len;
+    if (shareable && !(fault & PF_WRITE)) {
+        // A writable page is mapped as read-only too: it will be copied on
+        // the first write.
+        *attrs = 0;
+        return get_cached_page(task->cache, offset);
+    }
+
+    if (!shareable && !list_is_empty(&task->lent_pages)) {
+        // The page may have been allocated when another task accessed it
+        // through a grant (see grant_pager).
+        paddr_t paddr = find_page(&task->lent_pages, vaddr);
+        if (paddr) {
+            *attrs = writable ? PAGE_WRITABLE : 0;
+            return paddr;
         }
     }
 
-    // Zeroed pages.
-    vaddr_t zeroed_pages_start = (vaddr_t) __zeroed_pages;
-    vaddr_t zeroed_pages_end = zeroed_pages_start + ZEROED_PAGES_SIZE;
-    if (zeroed_pages_start <= vaddr && vaddr < zeroed_pages_end) {
-        // The accessed page is zeroed one (.bss section, stack, or heap).
-        paddr_t paddr = pages_alloc(1);
-        memset((void *) paddr, 0, PAGE_SIZE);
-        return paddr;
+    // Allocate a private page and fill it with the file data.
+    paddr_t paddr = own_page(task, vaddr, pages_alloc(1));
+    if (shareable && task->cache->pages[offset / PAGE_SIZE]) {
+        memcpy((void *) paddr,
+               (void *) task->cache->pages[offset / PAGE_SIZE], PAGE_SIZE);
+    } else {
+        fill_page(task->file, offset, paddr);
     }
 
-    // Look for the associated program header.
-    struct elf64_phdr *phdr = NULL;
-    for (unsigned i = 0; i < task->ehdr->e_phnum; i++) {
-        // Ignore GNU_STACK
-        if (!task->phdrs[i].p_vaddr) {
-            continue;
-        }
+    *attrs = writable ? PAGE_WRITABLE : 0;
+    return paddr;
+}
 
-        vaddr_t start = task->phdrs[i].p_vaddr;
-        vaddr_t end = start + task->phdrs[i].p_memsz;
-        if (start <= vaddr && vaddr <= end) {
-            phdr = &task->phdrs[i];
-            break;
+static paddr_t pager(struct task *task, vaddr_t vaddr, pagefault_t fault,
+                     pageattrs_t *attrs);
+
+/// Resolves a page fault in pages granted by another task: map the page the
+/// granting task has, or the one it would see on a read access if it has not
+/// touched the page yet.
+static paddr_t grant_pager(struct task *task, struct region *region,
+                           vaddr_t vaddr, pagefault_t fault,
+                           pageattrs_t *attrs) {
+    struct task *owner = &tasks[region->grant.task - 1];
+    if (((fault & PF_WRITE) && !region->grant.writable) || !owner->in_use) {
+        WARN("%s: invalid memory access at %p (perhaps segfault?)", task->name,
+             vaddr);
+        return 0;
+    }
+
+    // Look for the page first: the owner's pager would allocate a new page
+    // which the owner never sees. A page resolved here is recorded in the
+    // owner and mapped on its own access.
+    vaddr_t owner_vaddr = region->grant.vaddr + (vaddr - region->start);
+    paddr_t paddr = find_page(&owner->lent_pages, owner_vaddr);
+    if (!paddr) {
+        pageattrs_t owner_attrs;
+        paddr = pager(owner, owner_vaddr, 0, &owner_attrs);
+        if (!paddr) {
+            return 0;
         }
+
+        lend_page(owner, owner_vaddr, paddr);
     }
 
-    if (!phdr) {
+    // Keep the page alive while it's mapped even if the owner exits.
+    pages_incref(paddr, 1);
+    *attrs = region->grant.writable ? PAGE_WRITABLE : 0;
+    return own_page(task, vaddr, paddr);
+}
+
+static paddr_t pager(struct task *task, vaddr_t vaddr, pagefault_t fault,
+                     pageattrs_t *attrs) {
+    struct region *region = regions_lookup(&task->regions, vaddr);
+    if (!region || region->start >= vaddr + PAGE_SIZE) {
         WARN("invalid memory access (addr=%p), killing %s...", vaddr, task->name);
         return 0;
     }
-    // Allocate a page and fill it with the file data.
-    paddr_t paddr = pages_alloc(1);
-    size_t offset_in_segment = (vaddr - phdr->p_vaddr) + phdr->p_offset;
-    read_file(task->file, offset_in_segment, (void *) paddr, PAGE_SIZE);
-    return paddr;
+
+    switch (region->type) {
+        case REGION_ZEROED:
+            // The accessed page is zeroed one (.bss section, stack, or heap).
+            if (!(fault & PF_WRITE)) {
+                if (fault & PF_PRESENT) {
+                    WARN("%s: invalid memory access at %p (perhaps segfault?)",
+                         task->name, vaddr);
+                    return 0;
+                }
+
+                // Map the shared zero page as read-only until the first write.
+                *attrs = 0;
+                return zero_page;
+            }
+
+            // The first write: allocate a private page. We don't need to copy
+            // the zero page.
+            *attrs = PAGE_WRITABLE;
+            return own_page(task, vaddr, pages_alloc_zeroed());
+        case REGION_PAGE_AREA:
+            if (fault & PF_PRESENT) {
+                WARN("%s: invalid memory access at %p (perhaps segfault?)",
+                     task->name, vaddr);
+                return 0;
+            }
+
+            *attrs = PAGE_WRITABLE;
+            return region->paddr + (vaddr - region->start);
+        case REGION_SEGMENT:
+            return segment_pager(task, region, vaddr, fault, attrs);
+        case REGION_GRANT:
+            return grant_pager(task, region, vaddr, fault, attrs);
+    }
+
+    UNREACHABLE();
+}
+
+/// Sets the timer to refill the pre-zeroed pages pool later if needed.
+static void schedule_zeroed_pool_refill(void) {
+    if (!refill_timer_set && !pages_zeroed_pool_is_full()) {
+        error_t err = timer_set(ZEROED_POOL_REFILL_INTERVAL);
+        ASSERT_OK(err);
+        refill_timer_set = true;
+    }
 }
 
 static void kill(struct task *task) {
     task_destroy(task->tid);
     task->in_use = false;
     free(task->file_header);
+
+    // Release pages mapped to the task.
+    LIST_FOR_EACH (chunk, &task->owned_pages, struct owned_pages, next) {
+        for (size_t i = 0; i < chunk->num_pages; i++) {
+            pages_decref(chunk->pages[i].paddr, 1);
+        }
+    }
+
+    free_pages_list(&task->owned_pages);
+    free_pages_list(&task->lent_pages);
+    regions_free(&task->lent_ranges);
+
+    for (struct region *region = regions_lookup(&task->regions, 0); region;
+         region = regions_next(&task->regions, region)) {
+        if (region->type == REGION_PAGE_AREA) {
+            pages_decref(region->paddr,
+                         (region->end - region->start) / PAGE_SIZE);
+        }
+    }
+
+    regions_free(&task->regions);
 }
 
 /// Allocates a virtual address space by so-called the bump pointer allocation
@@ -164,7 +468,6 @@ static vaddr_t alloc_virt_pages(struct task *task, size_t num_pages) {
 
     if (vaddr + size >= (vaddr_t) __free_vaddr_end) {
         // Task's virtual memory space has been exhausted.
-        kill(task);
         return 0;
     }
 
@@ -179,23 +482,115 @@ static error_t alloc_pages(struct task *task, vaddr_t *vaddr, paddr_t *paddr,
     }
 
     *vaddr = alloc_virt_pages(task, num_pages);
+    if (!*vaddr) {
+        return ERR_NO_MEMORY;
+    }
+
     if (*paddr) {
-        pages_incref(paddr2pfn(*paddr), num_pages);
+        pages_incref(*paddr, num_pages);
+    } else if (num_pages == 1) {
+        *paddr = pages_alloc_zeroed();
     } else {
+        // Pages could have been used by a killed task: don't leak its data.
         *paddr = pages_alloc(num_pages);
+        memset((void *) *paddr, 0, num_pages * PAGE_SIZE);
+    }
+
+    struct region area;
+    area.start = *vaddr;
+    area.end = *vaddr + num_pages * PAGE_SIZE;
+    area.type = REGION_PAGE_AREA;
+    area.paddr = *paddr;
+    regions_add(&task->regions, &area);
+    return OK;
+}
+
+/// Maps the pages of `owner` into `task`. Writable pages are shared only if
+/// they're allocated by ALLOC_PAGES_MSG: other pages could be replaced by
+/// copy-on-write.
+static error_t grant_pages(struct task *owner, task_t tid, vaddr_t owner_vaddr,
+                           size_t num_pages, bool writable, vaddr_t *vaddr) {
+    // Note that tid 1 is init itself.
+    if (tid <= 1 || tid > TASKS_MAX || !tasks[tid - 1].in_use
+        || !IS_ALIGNED(owner_vaddr, PAGE_SIZE)) {
+        return ERR_INVALID_ARG;
+    }
+
+    // The owner is allowed to grant only its own pages.
+    for (size_t i = 0; i < num_pages; i++) {
+        vaddr_t page = owner_vaddr + i * PAGE_SIZE;
+        struct region *region = regions_lookup(&owner->regions, page);
+        if (!region || region->start >= page + PAGE_SIZE) {
+            return ERR_INVALID_ARG;
+        }
+
+        if (writable && region->type != REGION_PAGE_AREA) {
+            return ERR_NOT_PERMITTED;
+        }
+    }
+
+    struct task *task = &tasks[tid - 1];
+    *vaddr = alloc_virt_pages(task, num_pages);
+    if (!*vaddr) {
+        return ERR_NO_MEMORY;
+    }
+
+    // Pages the owner has already touched are lent as they are. Look them up
+    // here once rather than on each fault in grant_pager. Pages allocated
+    // later are recorded by own_page.
+    struct region_header range;
+    range.start = owner_vaddr;
+    range.end = owner_vaddr + num_pages * PAGE_SIZE;
+    regions_add(&owner->lent_ranges, &range);
+    LIST_FOR_EACH (chunk, &owner->owned_pages, struct owned_pages, next) {
+        for (size_t i = 0; i < chunk->num_pages; i++) {
+            struct owned_page *page = &chunk->pages[i];
+            if (range.start <= page->vaddr && page->vaddr < range.end) {
+                lend_page(owner, page->vaddr, page->paddr);
+            }
+        }
+    }
+
+    struct region grant;
+    grant.start = *vaddr;
+    grant.end = *vaddr + num_pages * PAGE_SIZE;
+    grant.type = REGION_GRANT;
+    grant.grant.task = owner->tid;
+    grant.grant.vaddr = owner_vaddr;
+    grant.grant.writable = writable;
+    regions_add(&task->regions, &grant);
+    return OK;
+}
+
+/// Checks that the pages at `vaddr` in `task` are granted by `owner`.
+static error_t verify_grant(struct task *task, task_t owner, vaddr_t vaddr,
+                            size_t num_pages, bool writable) {
+    // Granted pages are allocated below `__free_vaddr_end`.
+    vaddr_t limit = (vaddr_t) __free_vaddr_end;
+    if (!IS_ALIGNED(vaddr, PAGE_SIZE) || !num_pages || vaddr >= limit
+        || num_pages > (limit - vaddr) / PAGE_SIZE) {
+        return ERR_INVALID_ARG;
+    }
+
+    vaddr_t end = vaddr + num_pages * PAGE_SIZE;
+    while (vaddr < end) {
+        struct region *region = regions_lookup(&task->regions, vaddr);
+        if (!region || region->start > vaddr || region->type != REGION_GRANT
+            || region->grant.task != owner
+            || (writable && !region->grant.writable)) {
+            return ERR_NOT_PERMITTED;
+        }
+
+        vaddr = region->end;
     }
 
-    struct page_area *area = malloc(sizeof(*area));
-    area->vaddr = *vaddr;
-    area->paddr = *paddr;
-    area->num_pages = num_pages;
-    list_push_back(&task->page_areas, &area->next);
     return OK;
 }
 
 void main(void) {
     INFO("starting...");
     pages_init();
+    zero_page = pages_alloc_zeroed();
 
     for (int i = 0; i < TASKS_MAX; i++) {
         tasks[i].in_use = false;
@@ -209,18 +604,34 @@ void main(void) {
     // Launch servers in initfs.
     struct initfs_file *files =
         (struct initfs_file *) (((uintptr_t) &__initfs) + __initfs.files_off);
+    file_caches = malloc(sizeof(*file_caches) * __initfs.num_files);
     for (uint32_t i = 0; i < __initfs.num_files; i++) {
-        launch_server(&files[i]);
+        struct file_cache *cache = &file_caches[i];
+        cache->file = &files[i];
+        cache->num_pages = ALIGN_UP(files[i].len, PAGE_SIZE) / PAGE_SIZE;
+        cache->pages = malloc(sizeof(paddr_t) * cache->num_pages);
+        memset(cache->pages, 0, sizeof(paddr_t) * cache->num_pages);
+        launch_server(cache);
     }
 
     // The mainloop: receive and handle messages.
     INFO("ready");
+    schedule_zeroed_pool_refill();
     while (true) {
         struct message m;
         error_t err = ipc_recv(IPC_ANY, &m);
         ASSERT_OK(err);
 
         switch (m.type) {
+            case NOTIFICATIONS_MSG:
+                if (m.notifications.data & NOTIFY_TIMER) {
+                    // We have nothing to do for now. Zero pages in advance to
+                    // take memset off page faults.
+                    refill_timer_set = false;
+                    pages_refill_zeroed_pool(ZEROED_POOL_REFILL_BATCH);
+                    schedule_zeroed_pool_refill();
+                }
+                break;
             case NOP_MSG:
                 m.type = NOP_MSG;
                 ipc_send(m.src, &m);
@@ -251,17 +662,20 @@ void main(void) {
                 ASSERT(task);
                 ASSERT(m.page_fault.task == task->tid);
 
+                pageattrs_t attrs;
                 paddr_t paddr =
-                    pager(task, m.page_fault.vaddr, m.page_fault.fault);
+                    pager(task, m.page_fault.vaddr, m.page_fault.fault, &attrs);
                 if (paddr) {
                     m.type = PAGE_FAULT_REPLY_MSG;
                     m.page_fault_reply.paddr = paddr;
-                    m.page_fault_reply.attrs = PAGE_WRITABLE;
+                    m.page_fault_reply.attrs = attrs;
                     error_t err = ipc_send_noblock(task->tid, &m);
                     ASSERT_OK(err);
                 } else {
                     kill(task);
                 }
+
+                schedule_zeroed_pool_refill();
                 break;
             }
             case LOOKUP_MSG: {
@@ -303,6 +717,42 @@ void main(void) {
                 ipc_send(m.src, &m);
                 break;
             }
+            case GRANT_PAGES_MSG: {
+                struct task *task = get_task_by_tid(m.src);
+                ASSERT(task);
+
+                vaddr_t vaddr;
+                error_t err = grant_pages(task, m.grant_pages.task,
+                                          m.grant_pages.vaddr,
+                                          m.grant_pages.num_pages,
+                                          m.grant_pages.writable, &vaddr);
+                if (err != OK) {
+                    ipc_send_err(m.src, err);
+                    break;
+                }
+
+                m.type = GRANT_PAGES_REPLY_MSG;
+                m.grant_pages_reply.vaddr = vaddr;
+                ipc_send(m.src, &m);
+                break;
+            }
+            case VERIFY_GRANT_MSG: {
+                struct task *task = get_task_by_tid(m.src);
+                ASSERT(task);
+
+                error_t err = verify_grant(task, m.verify_grant.task,
+                                           m.verify_grant.vaddr,
+                                           m.verify_grant.num_pages,
+                                           m.verify_grant.writable);
+                if (err != OK) {
+                    ipc_send_err(m.src, err);
+                    break;
+                }
+
+                m.type = VERIFY_GRANT_REPLY_MSG;
+                ipc_send(m.src, &m);
+                break;
+            }
             default:
                 WARN("unknown message type (type=%d)", m.type);
         }
@@ -1,10 +1,23 @@
 #include <std/printf.h>
+#include <cstring.h>
 #include "pages.h"
 
 static struct page pages[PAGES_MAX];
+/// The allocation bitmap. A bit is set if the page is in use.
+static uint64_t bitmap[BITMAP_NUM_WORDS];
+/// The free run summary tree. `runs[1]` is the root and the children of
+/// `runs[i]` are `runs[2 * i]` and `runs[2 * i + 1]`. Leaves start from
+/// `runs[BITMAP_NUM_WORDS]`.
+static struct free_run runs[2 * BITMAP_NUM_WORDS];
+/// Pre-zeroed pages. They're already allocated (i.e. ref_count is 1).
+static paddr_t zeroed_pool[ZEROED_POOL_MAX];
+static size_t zeroed_pool_len = 0;
 extern char __heap_end[];
 #define PAGES_BASE_ADDR ((paddr_t) __heap_end)
 
+STATIC_ASSERT(IS_ALIGNED(BITMAP_NUM_WORDS, 2));
+STATIC_ASSERT((BITMAP_NUM_WORDS & (BITMAP_NUM_WORDS - 1)) == 0);
+
 bool is_mappable_paddr(paddr_t paddr) {
     bool is_user_pages = paddr >= PAGES_BASE_ADDR;
     bool is_mmio_pages = paddr <= 0x100000;
@@ -12,44 +25,203 @@ bool is_mappable_paddr(paddr_t paddr) {
 }
 
 pfn_t paddr2pfn(paddr_t paddr) {
-    ASSERT(is_mappable_paddr(paddr));
-    return paddr / PAGE_SIZE;
+    ASSERT(is_mappable_paddr(paddr) && paddr >= PAGES_BASE_ADDR);
+    return (paddr - PAGES_BASE_ADDR) / PAGE_SIZE;
+}
+
+/// Computes the free runs in a bitmap word.
+static void summarize_word(struct free_run *run, uint64_t word) {
+    if (!word) {
+        run->prefix = BITMAP_WORD_BITS;
+        run->suffix = BITMAP_WORD_BITS;
+        run->longest = BITMAP_WORD_BITS;
+        return;
+    }
+
+    run->prefix = __builtin_ctzll(word);
+    run->suffix = __builtin_clzll(word);
+
+    // Shrink each run of free pages by one page until all of them disappear.
+    uint64_t free_bits = ~word;
+    uint32_t longest = 0;
+    while (free_bits) {
+        free_bits &= free_bits >> 1;
+        longest++;
+    }
+    run->longest = longest;
+}
+
+/// Merges free runs of two adjacent subtrees. `child_len` is the number of
+/// pages in each subtree.
+static void merge_runs(struct free_run *run, struct free_run *left,
+                       struct free_run *right, size_t child_len) {
+    run->prefix =
+        (left->prefix == child_len) ? child_len + right->prefix : left->prefix;
+    run->suffix =
+        (right->suffix == child_len) ? child_len + left->suffix : right->suffix;
+    run->longest = MAX(MAX(left->longest, right->longest),
+                       left->suffix + right->prefix);
+}
+
+/// Updates the summary tree after modifying bitmap words in [first, last].
+static void update_runs(size_t first, size_t last) {
+    for (size_t i = first; i <= last; i++) {
+        summarize_word(&runs[BITMAP_NUM_WORDS + i], bitmap[i]);
+    }
+
+    // Update ancestors level by level.
+    size_t lo = (BITMAP_NUM_WORDS + first) / 2;
+    size_t hi = (BITMAP_NUM_WORDS + last) / 2;
+    size_t child_len = BITMAP_WORD_BITS;
+    while (lo > 0) {
+        for (size_t i = lo; i <= hi; i++) {
+            merge_runs(&runs[i], &runs[2 * i], &runs[2 * i + 1], child_len);
+        }
+
+        lo /= 2;
+        hi /= 2;
+        child_len *= 2;
+    }
+}
+
+/// Sets or clears the bit of the page in the bitmap. Don't forget to call
+/// `update_runs` afterwards.
+static void mark_page(pfn_t pfn, bool in_use) {
+    uint64_t mask = 1ULL << (pfn % BITMAP_WORD_BITS);
+    if (in_use) {
+        bitmap[pfn / BITMAP_WORD_BITS] |= mask;
+    } else {
+        bitmap[pfn / BITMAP_WORD_BITS] &= ~mask;
+    }
+}
+
+/// Looks for the first run of `num_pages` free pages in a bitmap word.
+static pfn_t find_in_word(size_t index, size_t num_pages) {
+    uint64_t word = bitmap[index];
+    for (size_t i = 0; i + num_pages <= BITMAP_WORD_BITS; i++) {
+        uint64_t mask = (num_pages == BITMAP_WORD_BITS)
+                            ? ~0ULL
+                            : ((1ULL << num_pages) - 1) << i;
+        if ((word & mask) == 0) {
+            return index * BITMAP_WORD_BITS + i;
+        }
+    }
+
+    UNREACHABLE();
+}
+
+/// Looks for the first (lowest) run of `num_pages` free pages.
+static pfn_t find_free_run(size_t num_pages) {
+    size_t node = 1;
+    size_t len = PAGES_MAX;
+    while (node < BITMAP_NUM_WORDS) {
+        size_t child_len = len / 2;
+        struct free_run *left = &runs[2 * node];
+        struct free_run *right = &runs[2 * node + 1];
+        if (left->longest >= num_pages) {
+            node = 2 * node;
+        } else if (left->suffix + right->prefix >= num_pages) {
+            // The run spans both subtrees.
+            size_t node_start = (node * len) - PAGES_MAX;
+            return node_start + child_len - left->suffix;
+        } else {
+            node = 2 * node + 1;
+        }
+
+        len = child_len;
+    }
+
+    return find_in_word(node - BITMAP_NUM_WORDS, num_pages);
+}
+
+/// Increments the reference counters of pages. A free page gets allocated.
+void pages_incref(paddr_t paddr, size_t num_pages) {
+    if (paddr < PAGES_BASE_ADDR) {
+        // Not managed by the allocator (e.g. legacy MMIO areas).
+        return;
+    }
+
+    pfn_t pfn = paddr2pfn(paddr);
+    ASSERT(pfn + num_pages <= PAGES_MAX);
+    for (size_t i = 0; i < num_pages; i++) {
+        if (pages[pfn + i].ref_count++ == 0) {
+            mark_page(pfn + i, true);
+        }
+    }
+
+    update_runs(pfn / BITMAP_WORD_BITS,
+                (pfn + num_pages - 1) / BITMAP_WORD_BITS);
 }
 
-void pages_incref(pfn_t pfn, size_t num_pages) {
+/// Decrements the reference counters of pages. A page is freed when its
+/// counter reaches zero.
+void pages_decref(paddr_t paddr, size_t num_pages) {
+    if (paddr < PAGES_BASE_ADDR) {
+        // Not managed by the allocator (e.g. legacy MMIO areas).
+        return;
+    }
+
+    pfn_t pfn = paddr2pfn(paddr);
     ASSERT(pfn + num_pages <= PAGES_MAX);
     for (size_t i = 0; i < num_pages; i++) {
-        pages[pfn + i].ref_count = 1;
+        ASSERT(pages[pfn + i].ref_count > 0);
+        if (--pages[pfn + i].ref_count == 0) {
+            mark_page(pfn + i, false);
+        }
     }
+
+    update_runs(pfn / BITMAP_WORD_BITS,
+                (pfn + num_pages - 1) / BITMAP_WORD_BITS);
 }
 
 /// Allocates continuous physical memory pages. It always returns a valid
 /// physical address: when it runs out of memory, it panics.
 paddr_t pages_alloc(size_t num_pages) {
-    pfn_t i;
-    for (i = 0; i < PAGES_MAX; i++) {
-        size_t j = 0;
-        while (j < num_pages) {
-            if (pages[i + j].ref_count > 0) {
-                break;
-            }
-
-            j++;
-        }
+    DEBUG_ASSERT(num_pages > 0);
+    if (runs[1].longest < num_pages) {
+        PANIC("out of memory");
+    }
 
-        if (j == num_pages) {
-            // Found sufficiently large free physical pages.
-            pages_incref(i, num_pages);
-            paddr_t paddr = PAGES_BASE_ADDR + i * PAGE_SIZE;
-            return paddr;
-        }
+    pfn_t pfn = find_free_run(num_pages);
+    paddr_t paddr = PAGES_BASE_ADDR + pfn * PAGE_SIZE;
+    pages_incref(paddr, num_pages);
+    return paddr;
+}
+
+/// Allocates a zero-filled page. It takes one from the pool of pre-zeroed
+/// pages or zeroes a new page if the pool is empty.
+paddr_t pages_alloc_zeroed(void) {
+    if (zeroed_pool_len > 0) {
+        return zeroed_pool[--zeroed_pool_len];
+    }
+
+    paddr_t paddr = pages_alloc(1);
+    memset((void *) paddr, 0, PAGE_SIZE);
+    return paddr;
+}
+
+/// Zeroes at most `max_pages` pages into the pool. It's intended to be called
+/// when the init task is idle.
+void pages_refill_zeroed_pool(size_t max_pages) {
+    while (max_pages-- > 0 && zeroed_pool_len < ZEROED_POOL_MAX) {
+        paddr_t paddr = pages_alloc(1);
+        memset((void *) paddr, 0, PAGE_SIZE);
+        zeroed_pool[zeroed_pool_len++] = paddr;
     }
+}
 
-    PANIC("out of memory");
+bool pages_zeroed_pool_is_full(void) {
+    return zeroed_pool_len == ZEROED_POOL_MAX;
 }
 
 void pages_init(void) {
     for (pfn_t i = 0; i < PAGES_MAX; i++) {
         pages[i].ref_count = 0;
     }
+
+    for (size_t i = 0; i < BITMAP_NUM_WORDS; i++) {
+        bitmap[i] = 0;
+    }
+
+    update_runs(0, BITMAP_NUM_WORDS - 1);
 }
@@ -3,7 +3,8 @@
 
 #include <types.h>
 
-/// Page Frame Number.
+/// Page Frame Number. It's relative to the beginning of the memory pages
+/// managed by the allocator.
 typedef unsigned pfn_t;
 #define PAGES_MAX ((4ULL * 1024 * 1024 * 1024) / PAGE_SIZE)
 
@@ -11,10 +12,33 @@ struct page {
     unsigned ref_count;
 };
 
+/// The bitmap of in-use pages is summarized in a complete binary tree to find
+/// a sufficiently long run of free pages in O(log n). Each leaf covers a bitmap
+/// word (BITMAP_WORD_BITS pages).
+#define BITMAP_WORD_BITS  64
+#define BITMAP_NUM_WORDS  (PAGES_MAX / BITMAP_WORD_BITS)
+
+/// The lengths of free page runs in a subtree.
+struct free_run {
+    /// The number of contiguous free pages from the beginning.
+    uint32_t prefix;
+    /// The number of contiguous free pages at the end.
+    uint32_t suffix;
+    /// The longest contiguous free pages.
+    uint32_t longest;
+};
+
+/// The maximum number of pre-zeroed pages.
+#define ZEROED_POOL_MAX 64
+
 bool is_mappable_paddr(paddr_t paddr);
 pfn_t paddr2pfn(paddr_t paddr);
-void pages_incref(pfn_t pfn, size_t num_pages);
+void pages_incref(paddr_t paddr, size_t num_pages);
+void pages_decref(paddr_t paddr, size_t num_pages);
 paddr_t pages_alloc(size_t num_pages);
+paddr_t pages_alloc_zeroed(void);
+void pages_refill_zeroed_pool(size_t max_pages);
+bool pages_zeroed_pool_is_full(void);
 void pages_init(void);
 
 #endif
@@ -1,23 +1,127 @@
 #include <std/printf.h>
 #include <std/syscall.h>
 #include <std/malloc.h>
+#include <std/io.h>
+#include <blk_queue.h>
 #include <message.h>
 #include <cstring.h>
 
 #define SECTOR_SIZE 512
 #define BUF_SIZE 8192
+#define QUEUES_MAX 4
 extern uint8_t __image[];
 extern uint8_t __image_end[];
 
+/// An asynchronous I/O queue attached by a client.
+struct queue {
+    task_t client;
+    struct blk_queue *ring;
+    uint8_t *data;
+    size_t data_len;
+};
+
+static struct queue queues[QUEUES_MAX];
+static size_t disk_size;
+
+static error_t do_request(struct queue *queue, struct blk_request *req) {
+    if (req->op != BLK_OP_READ || req->num_sg > BLK_SG_MAX) {
+        return ERR_INVALID_ARG;
+    }
+
+    size_t offset = req->sector * SECTOR_SIZE;
+    for (int i = 0; i < req->num_sg; i++) {
+        struct blk_sg *sg = &req->sg[i];
+        if (sg->len % SECTOR_SIZE != 0
+            || (size_t) sg->offset + sg->len > queue->data_len
+            || offset + sg->len > disk_size || offset + sg->len < offset) {
+            return ERR_INVALID_ARG;
+        }
+
+        memcpy(&queue->data[sg->offset], &__image[offset], sg->len);
+        offset += sg->len;
+    }
+
+    return OK;
+}
+
+/// Processes submitted requests and notifies the client of completions.
+static void process_queue(struct queue *queue) {
+    struct blk_queue *ring = queue->ring;
+    bool completed = false;
+    while (ring->sq_head != ring->sq_tail
+           && ring->cq_tail - ring->cq_head < BLK_QUEUE_DEPTH) {
+        memory_barrier();
+        // Copy the request not to be affected by the client's modifications.
+        struct blk_request req = ring->sq[ring->sq_head % BLK_QUEUE_DEPTH];
+        ring->sq_head++;
+
+        struct blk_completion *c = &ring->cq[ring->cq_tail % BLK_QUEUE_DEPTH];
+        c->tag = req.tag;
+        c->status = do_request(queue, &req);
+        memory_barrier();
+        ring->cq_tail++;
+        completed = true;
+    }
+
+    if (completed) {
+        ipc_notify(queue->client, NOTIFY_NEW_DATA);
+    }
+}
+
+static error_t attach_queue(task_t client, vaddr_t vaddr, size_t num_pages) {
+    if (num_pages < 2) {
+        return ERR_INVALID_ARG;
+    }
+
+    // We write into the pages: make sure they're granted by the client.
+    error_t err = io_verify_grant(client, vaddr, num_pages, true);
+    if (IS_ERROR(err)) {
+        return err;
+    }
+
+    for (int i = 0; i < QUEUES_MAX; i++) {
+        if (!queues[i].client) {
+            queues[i].client = client;
+            queues[i].ring = (struct blk_queue *) vaddr;
+            queues[i].data = (uint8_t *) vaddr + PAGE_SIZE;
+            queues[i].data_len = (num_pages - 1) * PAGE_SIZE;
+            return OK;
+        }
+    }
+
+    return ERR_NO_MEMORY;
+}
+
 void main(void) {
     TRACE("ready");
-    size_t disk_size = (uintptr_t) __image_end - (uintptr_t) __image;
+    disk_size = (uintptr_t) __image_end - (uintptr_t) __image;
     while (true) {
         struct message m;
         error_t err = ipc_recv(IPC_ANY, &m);
         ASSERT_OK(err);
 
         switch (m.type) {
+            case NOTIFICATIONS_MSG:
+                if (m.notifications.data & NOTIFY_NEW_DATA) {
+                    for (int i = 0; i < QUEUES_MAX; i++) {
+                        if (queues[i].client) {
+                            process_queue(&queues[i]);
+                        }
+                    }
+                }
+                break;
+            case BLK_ATTACH_QUEUE_MSG: {
+                err = attach_queue(m.src, m.blk_attach_queue.vaddr,
+                                   m.blk_attach_queue.num_pages);
+                if (IS_ERROR(err)) {
+                    ipc_reply_err(m.src, err);
+                    break;
+                }
+
+                m.type = BLK_ATTACH_QUEUE_REPLY_MSG;
+                ipc_reply(m.src, &m);
+                break;
+            }
             case BLK_READ_MSG: {
                 size_t offset = m.blk_read.sector * SECTOR_SIZE;
                 size_t len = m.blk_read.num_sectors * SECTOR_SIZE;
@@ -32,6 +136,47 @@ void main(void) {
                 ipc_reply(m.src, &m);
                 break;
             }
+            case BLK_WRITE_MSG: {
+                size_t offset = m.blk_write.sector * SECTOR_SIZE;
+                size_t len = m.blk_write.len;
+                if (len % SECTOR_SIZE != 0 || offset + len > disk_size
+                    || offset + len < offset) {
+                    ipc_reply_err(m.src, ERR_NOT_ACCEPTABLE);
+                    free(m.blk_write.data);
+                    break;
+                }
+
+                // Note that the image mapped by BLK_MAP_MSG is not updated:
+                // we get a private copy of the written page.
+                memcpy(&__image[offset], m.blk_write.data, len);
+                free(m.blk_write.data);
+                m.type = BLK_WRITE_REPLY_MSG;
+                ipc_reply(m.src, &m);
+                break;
+            }
+            case BLK_MAP_MSG: {
+                // Ask init to map the image into the client as read-only.
+                task_t client = m.src;
+                m.type = GRANT_PAGES_MSG;
+                m.grant_pages.task = client;
+                m.grant_pages.vaddr = (vaddr_t) __image;
+                m.grant_pages.num_pages =
+                    ALIGN_UP(disk_size, PAGE_SIZE) / PAGE_SIZE;
+                m.grant_pages.writable = false;
+                err = ipc_call(INIT_TASK_TID, &m);
+                if (IS_ERROR(err)) {
+                    ipc_reply_err(client, err);
+                    break;
+                }
+
+                ASSERT(m.type == GRANT_PAGES_REPLY_MSG);
+                vaddr_t vaddr = m.grant_pages_reply.vaddr;
+                m.type = BLK_MAP_REPLY_MSG;
+                m.blk_map_reply.vaddr = vaddr;
+                m.blk_map_reply.num_sectors = disk_size / SECTOR_SIZE;
+                ipc_reply(client, &m);
+                break;
+            }
             default:
                 TRACE("unknown message %d", m.type);
         }
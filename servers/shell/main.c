@@ -150,6 +150,46 @@ static void clear_command(UNUSED int argc, UNUSED char **argv) {
     cursor_y = 0;
 }
 
+static void ls_command(int argc, char **argv) {
+    char *path = (argc > 1) ? argv[1] : "/";
+    offset_t cookie = 0;
+    while (true) {
+        // Each reply contains a batch of entries.
+        struct message m;
+        m.type = FS_READDIR_MSG;
+        m.fs_readdir.path = path;
+        m.fs_readdir.len = strlen(path) + 1;
+        m.fs_readdir.cookie = cookie;
+        error_t err = ipc_call(fs_server, &m);
+        if (err == ERR_END) {
+            break;
+        }
+
+        if (IS_ERROR(err)) {
+            WARN("ls: failed to read %s: %s", path, err2str(err));
+            break;
+        }
+
+        ASSERT(m.type == FS_READDIR_REPLY_MSG);
+        struct fs_dirent *entries = m.fs_readdir_reply.entries;
+        size_t num_entries = m.fs_readdir_reply.len / sizeof(*entries);
+        for (size_t i = 0; i < num_entries; i++) {
+            if (entries[i].attr & FS_ATTR_DIRECTORY) {
+                printf("%s/\n", entries[i].name);
+            } else {
+                printf("%s (%d bytes)\n", entries[i].name, entries[i].size);
+            }
+        }
+
+        free(entries);
+        if (m.fs_readdir_reply.end) {
+            break;
+        }
+
+        cookie = m.fs_readdir_reply.next_cookie;
+    }
+}
+
 struct command {
     const char *name;
     void (*run)(int argc, char **argv);
@@ -158,6 +198,7 @@ struct command {
 static struct command commands[] = {
     { .name = "echo", .run = echo_command },
     { .name = "clear", .run = clear_command },
+    { .name = "ls", .run = ls_command },
     { .name = NULL, .run = NULL },
 };
 
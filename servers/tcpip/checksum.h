@@ -35,8 +35,22 @@ static inline void checksum_update_uint32(checksum_t *c, uint32_t data) {
 }
 
 static inline void checksum_update_mbuf(checksum_t *c, mbuf_t mbuf) {
+    // mbufs could have odd lengths since they share clusters at arbitrary
+    // offsets. If the previous one ended in the middle of a word, the first
+    // byte is the upper half of the word.
+    bool odd = false;
     while (mbuf) {
-        checksum_update(c, mbuf_data(mbuf), mbuf_len_one(mbuf));
+        const uint8_t *p = mbuf_data(mbuf);
+        size_t len = mbuf_len_one(mbuf);
+        if (odd && len > 0) {
+            *c += p[0] << 8;
+            p++;
+            len--;
+            odd = false;
+        }
+
+        checksum_update(c, p, len);
+        odd ^= len % 2 != 0;
         mbuf = mbuf->next;
     }
 }
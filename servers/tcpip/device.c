@@ -2,6 +2,7 @@
 #include <cstring.h>
 #include "device.h"
 #include "dhcp.h"
+#include "ethernet.h"
 #include "ipv4.h"
 
 static struct device devices[DEVICES_MAX];
@@ -57,6 +58,7 @@ device_t device_new(const char *name, transmit_fn_t transmit,
     device->link_transmit = link_transmit;
     device->dhcp_enabled = false;
     device->dhcp_leased = false;
+    device->mtu = ETHERNET_MTU;
     memset(device->macaddr, 0, MACADDR_LEN);
     memset(&device->ipaddr, 0, sizeof(ipaddr_t));
     memset(&device->netmask, 0, sizeof(ipaddr_t));
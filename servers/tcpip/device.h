@@ -21,6 +21,8 @@ struct device {
     bool dhcp_enabled;
     bool dhcp_leased;
     macaddr_t macaddr;
+    /// The maximum size of an IP packet sent through the device.
+    size_t mtu;
     ipaddr_t ipaddr;
     ipaddr_t gateway;
     ipaddr_t netmask;
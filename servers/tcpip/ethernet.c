@@ -20,15 +20,14 @@ void ethernet_transmit(struct device *device, enum ether_type type,
         return;
     }
 
-    struct ethernet_header header;
-    memcpy(header.dst, dst_macaddr, MACADDR_LEN);
-    memcpy(header.src, device->macaddr, MACADDR_LEN);
-    header.type = hton16(type);
-    mbuf_t pkt = mbuf_new(&header, sizeof(header));
-    mbuf_prepend(payload, pkt);
+    // Prepend the header into the headroom.
+    struct ethernet_header *header = mbuf_push(&payload, sizeof(*header));
+    memcpy(header->dst, dst_macaddr, MACADDR_LEN);
+    memcpy(header->src, device->macaddr, MACADDR_LEN);
+    header->type = hton16(type);
 
-    // Transmit the packet. `pkt` is freed in the callback.
-    device->link_transmit(device, pkt);
+    // Transmit the packet. `payload` is freed in the callback.
+    device->link_transmit(device, payload);
 }
 
 void ethernet_receive(struct device *device, const void *pkt, size_t len) {
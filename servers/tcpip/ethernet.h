@@ -4,6 +4,9 @@
 #include "mbuf.h"
 #include "tcpip.h"
 
+/// The maximum payload size of an ethernet frame.
+#define ETHERNET_MTU 1500
+
 struct ethernet_header {
     macaddr_t dst;
     macaddr_t src;
@@ -34,11 +34,9 @@ void ipv4_transmit(ipv4addr_t dst, ip_proto_t proto, mbuf_t payload) {
     checksum_update(&checksum, &header, sizeof(header));
     header.checksum = checksum_finish(&checksum);
 
-    mbuf_t pkt = mbuf_new(&header, sizeof(header));
-    mbuf_prepend(payload, pkt);
-
+    memcpy(mbuf_push(&payload, sizeof(header)), &header, sizeof(header));
     device->transmit(device, ETHER_TYPE_IPV4,
-                     &(ipaddr_t){.type = IP_TYPE_V4, .v4 = dst}, pkt);
+                     &(ipaddr_t){.type = IP_TYPE_V4, .v4 = dst}, payload);
 }
 
 static bool is_our_ipaddr(struct device *device, ipv4addr_t ipaddr) {
@@ -44,15 +44,20 @@ static void transmit(device_t device, mbuf_t pkt) {
     size_t len = mbuf_len(pkt);
     DEBUG_ASSERT(len <= 2048 && "too long packet");
 
-    uint8_t *payload = malloc(len);
-    mbuf_read(&pkt, payload, len);
-    mbuf_delete(pkt);
+    // Headers are prepended into the headroom so the packet is usually in a
+    // single buffer. Otherwise, copy it into a new contiguous one.
+    if (pkt->next) {
+        mbuf_t flattened = mbuf_copy(pkt, 0, len);
+        mbuf_delete(pkt);
+        pkt = flattened;
+    }
 
     struct driver *driver = device->arg;
     struct packet *packet = malloc(sizeof(*packet));
     packet->dst = driver->tid;
+    packet->pkt = pkt;
     packet->m.type = NET_TX_MSG;
-    packet->m.net_tx.payload = payload;
+    packet->m.net_tx.payload = (void *) mbuf_data(pkt);
     packet->m.net_tx.len = len;
     list_push_back(&driver->tx_queue, &packet->next);
 
@@ -249,11 +254,47 @@ void main(void) {
                     break;
                 }
 
-                tcp_write(c->sock, m.tcpip_write.data, m.tcpip_write.len);
-                ipc_send_err(m.src, OK);
+                error_t err = tcp_write(c->sock, m.tcpip_write.data,
+                                        m.tcpip_write.len);
+                ipc_send_err(m.src, err);
                 free(m.tcpip_write.data);
                 break;
             }
+            case TCPIP_SET_OPTION_MSG: {
+                struct client *c =
+                    map_get_handle(clients, &m.tcpip_set_option.handle);
+                if (!c) {
+                    ipc_send_err(m.src, ERR_INVALID_ARG);
+                    break;
+                }
+
+                int value = m.tcpip_set_option.value;
+                switch (m.tcpip_set_option.option) {
+                    case TCPIP_OPT_CONGESTION_CONTROL:
+                        if (value != TCPIP_CC_NEWRENO
+                            && value != TCPIP_CC_CUBIC) {
+                            ipc_send_err(m.src, ERR_INVALID_ARG);
+                            break;
+                        }
+
+                        tcp_set_cc(c->sock, (value == TCPIP_CC_NEWRENO)
+                                                ? TCP_CC_NEWRENO
+                                                : TCP_CC_CUBIC);
+                        ipc_send_err(m.src, OK);
+                        break;
+                    case TCPIP_OPT_RCVBUF:
+                        ipc_send_err(m.src,
+                                     tcp_set_rx_buf_size(c->sock, value));
+                        break;
+                    case TCPIP_OPT_SNDBUF:
+                        ipc_send_err(m.src,
+                                     tcp_set_tx_buf_size(c->sock, value));
+                        break;
+                    default:
+                        ipc_send_err(m.src, ERR_INVALID_ARG);
+                }
+                break;
+            }
             case TCPIP_REGISTER_DEVICE_MSG:
                 register_device(m.src, &m.tcpip_register_device.macaddr);
                 break;
@@ -291,7 +332,7 @@ void main(void) {
                 }
 
                 ipc_reply(m.src, &pkt->m);
-                free(pkt->m.net_tx.payload);
+                mbuf_delete(pkt->pkt);
                 free(pkt);
                 break;
             }
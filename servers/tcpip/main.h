@@ -13,6 +13,8 @@ struct driver {
 struct packet {
     list_elem_t next;
     task_t dst;
+    /// The packet referred by `m`. Deleted once it's sent to the driver.
+    mbuf_t pkt;
     struct message m;
 };
 
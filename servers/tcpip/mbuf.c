@@ -1,29 +1,69 @@
 #include <std/malloc.h>
+#include <std/printf.h>
 #include <cstring.h>
 #include "mbuf.h"
 
-mbuf_t mbuf_alloc(void) {
-    struct mbuf *m = malloc(sizeof(*m));
+/// Free mbufs and clusters linked by `next`. They're allocated from the heap
+/// in chunks and never returned to it.
+static struct mbuf *free_mbufs = NULL;
+static struct mbuf_cluster *free_clusters = NULL;
+
+static struct mbuf *alloc_mbuf(struct mbuf_cluster *cluster, size_t offset,
+                               size_t offset_end) {
+    if (!free_mbufs) {
+        struct mbuf *chunk = malloc(sizeof(*chunk) * MBUF_POOL_CHUNK);
+        for (int i = 0; i < MBUF_POOL_CHUNK; i++) {
+            chunk[i].next = free_mbufs;
+            free_mbufs = &chunk[i];
+        }
+    }
+
+    struct mbuf *m = free_mbufs;
+    free_mbufs = m->next;
     m->next = NULL;
-    m->offset = 0;
-    m->offset_end = 0;
+    m->cluster = cluster;
+    m->offset = offset;
+    m->offset_end = offset_end;
+    cluster->ref_count++;
     return m;
 }
 
-mbuf_t mbuf_new(const void *data, size_t len) {
+static struct mbuf_cluster *alloc_cluster(void) {
+    if (!free_clusters) {
+        struct mbuf_cluster *chunk = malloc(sizeof(*chunk) * MBUF_POOL_CHUNK);
+        for (int i = 0; i < MBUF_POOL_CHUNK; i++) {
+            chunk[i].next = free_clusters;
+            free_clusters = &chunk[i];
+        }
+    }
+
+    struct mbuf_cluster *cluster = free_clusters;
+    free_clusters = cluster->next;
+    cluster->ref_count = 0;
+    return cluster;
+}
+
+/// Allocates an empty mbuf with a new cluster. The headroom is reserved in
+/// front of the data.
+mbuf_t mbuf_alloc(void) {
+    return alloc_mbuf(alloc_cluster(), MBUF_HEADROOM, MBUF_HEADROOM);
+}
+
+/// Copies data into new clusters. `headroom` is reserved in the first one.
+static mbuf_t new_chain(const void *data, size_t len, size_t headroom) {
     struct mbuf *head = NULL;
     struct mbuf *tail = NULL;
     const uint8_t *p = data;
     do {
-        size_t mbuf_len = MIN(len, MBUF_MAX_LEN);
-        struct mbuf *new_tail = mbuf_alloc();
+        size_t offset = head ? 0 : headroom;
+        size_t mbuf_len = MIN(len, MBUF_CLUSTER_SIZE - offset);
+        struct mbuf *new_tail = alloc_mbuf(alloc_cluster(), offset, offset);
         if (!head) {
             head = new_tail;
         }
 
-        new_tail->next = NULL;
-        new_tail->offset_end = mbuf_len;
-        memcpy(new_tail->data, p, mbuf_len);
+        new_tail->offset_end = offset + mbuf_len;
+        memcpy(&new_tail->cluster->data[offset], p, mbuf_len);
 
         if (tail) {
             tail->next = new_tail;
@@ -37,8 +77,21 @@ mbuf_t mbuf_new(const void *data, size_t len) {
     return head;
 }
 
+mbuf_t mbuf_new(const void *data, size_t len) {
+    return new_chain(data, len, MBUF_HEADROOM);
+}
+
 void mbuf_delete_one(mbuf_t mbuf) {
-    free(mbuf);
+    struct mbuf_cluster *cluster = mbuf->cluster;
+    DEBUG_ASSERT(cluster->ref_count > 0);
+    cluster->ref_count--;
+    if (!cluster->ref_count) {
+        cluster->next = free_clusters;
+        free_clusters = cluster;
+    }
+
+    mbuf->next = free_mbufs;
+    free_mbufs = mbuf;
 }
 
 // Deletes mbuf recursively.
@@ -54,8 +107,20 @@ void mbuf_delete(mbuf_t mbuf) {
     } while (mbuf);
 }
 
-void mbuf_prepend(mbuf_t mbuf, mbuf_t new_head) {
-    new_head->next = mbuf;
+/// Prepends `len` bytes in front of the data and returns the pointer to them.
+/// They're taken from the headroom of the first mbuf if possible: a new mbuf
+/// is prepended only if there's no space or the cluster is shared.
+void *mbuf_push(mbuf_t *mbuf, size_t len) {
+    DEBUG_ASSERT(len <= MBUF_HEADROOM);
+    struct mbuf *head = *mbuf;
+    if (head->cluster->ref_count > 1 || head->offset < len) {
+        head = mbuf_alloc();
+        head->next = *mbuf;
+        *mbuf = head;
+    }
+
+    head->offset -= len;
+    return &head->cluster->data[head->offset];
 }
 
 void mbuf_append(mbuf_t mbuf, mbuf_t new_tail) {
@@ -67,7 +132,24 @@ void mbuf_append(mbuf_t mbuf, mbuf_t new_tail) {
 }
 
 void mbuf_append_bytes(mbuf_t mbuf, const void *data, size_t len) {
-    mbuf_append(mbuf, mbuf_new(data, len));
+    struct mbuf *tail = mbuf;
+    while (tail->next) {
+        tail = tail->next;
+    }
+
+    // Fill the free space in the last cluster first unless it's shared with
+    // other mbufs.
+    if (tail->cluster->ref_count == 1) {
+        size_t copy_len = MIN(len, MBUF_CLUSTER_SIZE - tail->offset_end);
+        memcpy(&tail->cluster->data[tail->offset_end], data, copy_len);
+        tail->offset_end += copy_len;
+        data = (const uint8_t *) data + copy_len;
+        len -= copy_len;
+    }
+
+    if (len > 0) {
+        tail->next = new_chain(data, len, 0);
+    }
 }
 
 bool mbuf_is_empty(mbuf_t mbuf) {
@@ -75,7 +157,7 @@ bool mbuf_is_empty(mbuf_t mbuf) {
 }
 
 const void *mbuf_data(mbuf_t mbuf) {
-    return &mbuf->data[mbuf->offset];
+    return &mbuf->cluster->data[mbuf->offset];
 }
 
 size_t mbuf_len_one(mbuf_t mbuf) {
@@ -118,32 +200,57 @@ size_t mbuf_read(mbuf_t *mbuf, void *buf, size_t buf_len) {
     return read_len;
 }
 
-static void mbuf_copy(mbuf_t dst, mbuf_t src) {
-    dst->next = NULL;
-    dst->offset = src->offset;
-    dst->offset_end = src->offset_end;
-    memcpy(dst->data, src->data, mbuf_len_one(src));
+/// Copies `len` bytes at `off` in `mbuf` into a new mbuf chain. The data is
+/// contiguous (if it fits in a cluster) and headers can be prepended in place.
+mbuf_t mbuf_copy(mbuf_t mbuf, size_t off, size_t len) {
+    mbuf_t head = mbuf_alloc();
+    while (mbuf && len > 0) {
+        size_t mbuf_len = mbuf_len_one(mbuf);
+        if (off >= mbuf_len) {
+            // Skip mbufs in front of `off`.
+            off -= mbuf_len;
+            mbuf = mbuf->next;
+            continue;
+        }
+
+        size_t copy_len = MIN(len, mbuf_len - off);
+        mbuf_append_bytes(head, (const uint8_t *) mbuf_data(mbuf) + off,
+                          copy_len);
+        off = 0;
+        mbuf = mbuf->next;
+        len -= copy_len;
+    }
+
+    return head;
 }
 
-mbuf_t mbuf_peek(mbuf_t mbuf, size_t len) {
-    mbuf_t dst = mbuf_alloc();
-    mbuf_t head = dst;
-    mbuf_t src = mbuf;
-    while (src) {
-        size_t mbuf_len = mbuf_len_one(src);
-        mbuf_copy(dst, src);
-        if (len <= mbuf_len) {
-            dst->offset_end -= mbuf_len - len;
-            break;
+/// Splits the mbuf chain at `len` bytes. `mbuf` keeps the first `len` bytes
+/// and the rest is returned (NULL if there's no data beyond `len`). The data
+/// is not copied.
+mbuf_t mbuf_split(mbuf_t mbuf, size_t len) {
+    while (mbuf) {
+        size_t mbuf_len = mbuf_len_one(mbuf);
+        if (len < mbuf_len) {
+            // Split in the middle of the mbuf: the tail shares the cluster.
+            mbuf_t rest = alloc_mbuf(mbuf->cluster, mbuf->offset + len,
+                                     mbuf->offset_end);
+            rest->next = mbuf->next;
+            mbuf->offset_end = mbuf->offset + len;
+            mbuf->next = NULL;
+            return rest;
         }
 
-        dst->next = mbuf_alloc();
-        dst = dst->next;
-        src = src->next;
         len -= mbuf_len;
+        if (!len) {
+            mbuf_t rest = mbuf->next;
+            mbuf->next = NULL;
+            return rest;
+        }
+
+        mbuf = mbuf->next;
     }
 
-    return head;
+    return NULL;
 }
 
 size_t mbuf_discard(mbuf_t *mbuf, size_t len) {
@@ -171,16 +278,5 @@ size_t mbuf_discard(mbuf_t *mbuf, size_t len) {
 }
 
 void mbuf_truncate(mbuf_t mbuf, size_t len) {
-    while (mbuf && len > 0) {
-        size_t mbuf_len = mbuf_len_one(mbuf);
-        if (len < mbuf_len) {
-            mbuf->offset_end -= mbuf_len - len;
-            mbuf_delete(mbuf->next);
-            mbuf->next = NULL;
-            break;
-        }
-
-        len -= mbuf_len;
-        mbuf = mbuf->next;
-    }
+    mbuf_delete(mbuf_split(mbuf, len));
 }
@@ -3,13 +3,30 @@
 
 #include "tcpip.h"
 
-#define MBUF_MAX_LEN 512
+/// The size of a data cluster. A whole ethernet frame fits in a cluster.
+#define MBUF_CLUSTER_SIZE 2048
+/// The number of mbufs (or clusters) allocated at once when the pool is empty.
+#define MBUF_POOL_CHUNK 32
+/// The space reserved in front of the data in a new cluster. TCP (with
+/// options), IPv4, and Ethernet headers are prepended into it in place.
+#define MBUF_HEADROOM 128
 
+/// A reference-counted data buffer. It's shared by mbufs which refer to (a part
+/// of) the same data, and is returned to the pool when the last one is
+/// deleted.
+struct mbuf_cluster {
+    /// The next cluster in the free list.
+    struct mbuf_cluster *next;
+    unsigned ref_count;
+    uint8_t data[MBUF_CLUSTER_SIZE];
+};
+
+/// A segment of a packet. The data is `cluster->data[offset..offset_end]`.
 struct mbuf {
     struct mbuf *next;
+    struct mbuf_cluster *cluster;
     uint16_t offset;
     uint16_t offset_end;
-    uint8_t data[MBUF_MAX_LEN];
 };
 
 typedef struct mbuf *mbuf_t;
@@ -17,7 +34,7 @@ typedef struct mbuf *mbuf_t;
 mbuf_t mbuf_alloc(void);
 void mbuf_delete(mbuf_t mbuf);
 mbuf_t mbuf_new(const void *data, size_t len);
-void mbuf_prepend(mbuf_t mbuf, mbuf_t new_head);
+void *mbuf_push(mbuf_t *mbuf, size_t len);
 void mbuf_append(mbuf_t mbuf, mbuf_t new_tail);
 void mbuf_append_bytes(mbuf_t mbuf, const void *data, size_t len);
 const void *mbuf_data(mbuf_t mbuf);
@@ -25,7 +42,8 @@ size_t mbuf_len_one(mbuf_t mbuf);
 size_t mbuf_len(mbuf_t mbuf);
 bool mbuf_is_empty(mbuf_t mbuf);
 size_t mbuf_read(mbuf_t *mbuf, void *buf, size_t buf_len);
-mbuf_t mbuf_peek(mbuf_t mbuf, size_t len);
+mbuf_t mbuf_copy(mbuf_t mbuf, size_t off, size_t len);
+mbuf_t mbuf_split(mbuf_t mbuf, size_t len);
 size_t mbuf_discard(mbuf_t *mbuf, size_t len);
 void mbuf_truncate(mbuf_t mbuf, size_t len);
 
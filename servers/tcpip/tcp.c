@@ -1,4 +1,5 @@
 #include <list.h>
+#include <std/malloc.h>
 #include <std/printf.h>
 #include <cstring.h>
 #include "checksum.h"
@@ -60,6 +61,11 @@ static struct tcp_socket *tcp_lookup(endpoint_t *dst_ep, endpoint_t *src_ep) {
     return tcp_lookup_local(dst_ep);
 }
 
+/// Returns the initial congestion window (RFC 3390).
+static uint32_t tcp_initial_cwnd(uint16_t mss) {
+    return MIN(4 * mss, MAX(2 * mss, 4380));
+}
+
 tcp_sock_t tcp_new(void) {
     struct tcp_socket *sock = NULL;
     for (int i = 0; i < TCP_SOCKETS_MAX; i++) {
@@ -76,18 +82,50 @@ tcp_sock_t tcp_new(void) {
     sock->in_use = true;
     sock->state = TCP_STATE_CLOSED;
     sock->pendings = 0;
-    sock->next_seqno = 0;
-    sock->last_seqno = 0;
+    sock->snd_una = 0;
+    sock->snd_nxt = 0;
+    sock->snd_max = 0;
     sock->last_ack = 0;
     sock->local_winsize = TCP_RX_BUF_SIZE;
+    sock->rx_buf_size = TCP_RX_BUF_SIZE;
+    sock->rx_autotune = true;
+    sock->autotune_read_len = 0;
+    sock->autotune_at = 0;
+    sock->tx_buf_size = 0;
+    sock->window_scaling = false;
+    sock->snd_wscale = 0;
+    sock->rcv_wscale = 0;
+    sock->timestamps = false;
+    sock->ts_recent = 0;
+    sock->last_ack_sent = 0;
+    sock->remote_winsize = 0;
+    sock->unacked_len = 0;
+    sock->delayed_ack_at = 0;
+    sock->mss = TCP_DEFAULT_MSS;
+    sock->sack_permitted = false;
     memset(&sock->local.addr, 0, sizeof(ipaddr_t));
     memset(&sock->remote.addr, 0, sizeof(ipaddr_t));
     sock->local.port = 0;
     sock->remote.port = 0;
     sock->rx_buf = mbuf_alloc();
     sock->tx_buf = mbuf_alloc();
+    list_init(&sock->ooo_segs);
+    sock->ooo_recent = 0;
     sock->retransmit_at = 0;
-    sock->num_retransmits = 0;
+    sock->srtt = 0;
+    sock->rttvar = 0;
+    sock->rto = TCP_RTO_INITIAL;
+    sock->has_srtt = false;
+    sock->rtt_timing = false;
+    sock->ts_una = 0;
+    sock->cc = TCP_CC_DEFAULT;
+    sock->cwnd = tcp_initial_cwnd(sock->mss);
+    sock->ssthresh = TCP_CWND_MAX;
+    sock->dup_acks = 0;
+    sock->in_recovery = false;
+    sock->recover = 0;
+    sock->cubic_wmax = 0;
+    sock->cubic_epoch_started = false;
     sock->backlog = 0;
     sock->listen_sock = NULL;
     list_init(&sock->backlog_socks);
@@ -96,9 +134,21 @@ tcp_sock_t tcp_new(void) {
     return sock;
 }
 
+/// Deletes the out-of-order segments.
+static void tcp_clear_ooo(struct tcp_socket *sock) {
+    struct tcp_ooo_segment *seg;
+    while ((seg = LIST_POP_FRONT(&sock->ooo_segs, struct tcp_ooo_segment,
+                                 next))
+           != NULL) {
+        mbuf_delete(seg->data);
+        free(seg);
+    }
+}
+
 void tcp_close(tcp_sock_t sock) {
     mbuf_delete(sock->rx_buf);
     mbuf_delete(sock->tx_buf);
+    tcp_clear_ooo(sock);
     list_remove(&sock->next);
     sock->in_use = false;
 }
@@ -124,6 +174,11 @@ void tcp_listen(tcp_sock_t sock, int backlog) {
     list_push_back(&active_socks, &sock->next);
 }
 
+void tcp_set_cc(tcp_sock_t sock, enum tcp_cc cc) {
+    sock->cc = cc;
+    sock->cubic_epoch_started = false;
+}
+
 tcp_sock_t tcp_accept(tcp_sock_t sock) {
     list_elem_t *elem = list_pop_front(&sock->backlog_socks);
     if (!elem) {
@@ -141,99 +196,311 @@ tcp_sock_t tcp_accept(tcp_sock_t sock) {
     return accepted_sock;
 }
 
-void tcp_write(tcp_sock_t sock, const void *data, size_t len) {
+static void tcp_set_pendings(struct tcp_socket *sock, uint32_t pendings) {
+    sock->pendings |= pendings;
+}
+
+static uint32_t tcp_clear_pendings(struct tcp_socket *sock) {
+    uint32_t pendings = sock->pendings;
+    sock->pendings = 0;
+    return pendings;
+}
+
+/// Returns the largest window we can advertise.
+static uint32_t tcp_max_window(struct tcp_socket *sock) {
+    return 0xffff << sock->rcv_wscale;
+}
+
+/// Resizes the receive buffer. The window grows (or shrinks) by the
+/// difference.
+static void tcp_resize_rx_buf(struct tcp_socket *sock, uint32_t size) {
+    uint32_t used = sock->rx_buf_size - sock->local_winsize;
+    sock->rx_buf_size = size;
+    sock->local_winsize = (size > used) ? size - used : 0;
+}
+
+/// Sets the size of the receive buffer and disables autotuning. It should
+/// be set before the connection is established: the window scale is
+/// determined by the size in the handshake.
+error_t tcp_set_rx_buf_size(tcp_sock_t sock, size_t size) {
+    if (size < TCP_BUF_SIZE_MIN || size > TCP_BUF_SIZE_MAX) {
+        return ERR_INVALID_ARG;
+    }
+
+    if (sock->state != TCP_STATE_LISTEN && sock->state != TCP_STATE_CLOSED) {
+        size = MIN(size, tcp_max_window(sock));
+    }
+
+    tcp_resize_rx_buf(sock, size);
+    sock->rx_autotune = false;
+    return OK;
+}
+
+error_t tcp_set_tx_buf_size(tcp_sock_t sock, size_t size) {
+    if (size < TCP_BUF_SIZE_MIN || size > TCP_BUF_SIZE_MAX) {
+        return ERR_INVALID_ARG;
+    }
+
+    sock->tx_buf_size = size;
+    return OK;
+}
+
+/// Appends data into the send buffer. If the size of the buffer is set, it
+/// fails if the data doesn't fit in the buffer.
+error_t tcp_write(tcp_sock_t sock, const void *data, size_t len) {
+    if (sock->tx_buf_size) {
+        if (len > sock->tx_buf_size) {
+            return ERR_TOO_LARGE;
+        }
+
+        if (mbuf_len(sock->tx_buf) + len > sock->tx_buf_size) {
+            return ERR_WOULD_BLOCK;
+        }
+    }
+
     mbuf_append_bytes(sock->tx_buf, data, len);
-    sock->retransmit_at = 0;
+    return OK;
+}
+
+/// Grows the receive buffer if the application reads more than half of it
+/// in an RTT: the window would limit the throughput otherwise. This is
+/// similar to Linux's dynamic right-sizing.
+static void tcp_autotune_rx(struct tcp_socket *sock, size_t read_len) {
+    if (!sock->rx_autotune) {
+        return;
+    }
+
+    sock->autotune_read_len += read_len;
+    msec_t now = sys_uptime();
+    if (now < sock->autotune_at + MAX(sock->srtt, TCP_CLOCK_GRANULARITY)) {
+        return;
+    }
+
+    uint32_t max_size = MIN(TCP_RX_BUF_MAX, tcp_max_window(sock));
+    uint32_t target = MIN((uint64_t) sock->autotune_read_len * 2, max_size);
+    if (target > sock->rx_buf_size) {
+        tcp_resize_rx_buf(sock, target);
+    }
+
+    sock->autotune_read_len = 0;
+    sock->autotune_at = now;
 }
 
 size_t tcp_read(tcp_sock_t sock, void *buf, size_t buf_len) {
     size_t read_len = mbuf_read(&sock->rx_buf, buf, buf_len);
     sock->local_winsize += read_len;
+    tcp_autotune_rx(sock, read_len);
+    if (sock->local_winsize - read_len < sock->mss
+        && sock->local_winsize >= sock->mss) {
+        // Tell the remote that the window has reopened.
+        tcp_set_pendings(sock, TCP_PEND_ACK);
+    }
+
     return read_len;
 }
 
-static void tcp_set_pendings(struct tcp_socket *sock, uint32_t pendings) {
-    sock->pendings |= pendings;
+/// Returns true if `a` is before `b` in the sequence number space.
+static bool seq_lt(uint32_t a, uint32_t b) {
+    return (int32_t) (a - b) < 0;
 }
 
-static uint32_t tcp_clear_pendings(struct tcp_socket *sock) {
-    uint32_t pendings = sock->pendings;
-    sock->pendings = 0;
-    return pendings;
+/// Returns the largest MSS which fits in the MTU of the device.
+static uint16_t tcp_device_mss(struct device *device) {
+    return device->mtu - sizeof(struct ipv4_header) - sizeof(struct tcp_header);
 }
 
-void tcp_transmit(tcp_sock_t sock) {
-    if (sock->retransmit_at && sys_uptime() < sock->retransmit_at) {
+/// Starts the retransmission timer unless it's already running.
+static void tcp_start_rxt_timer(struct tcp_socket *sock) {
+    if (sock->retransmit_at) {
         return;
     }
 
-    uint32_t flags = tcp_clear_pendings(sock);
-    mbuf_t payload = NULL;
-    uint8_t ctrl_flags = 0;
-    switch (sock->state) {
-        case TCP_STATE_ESTABLISHED:
-        case TCP_STATE_CLOSE_WAIT:
-            payload = mbuf_peek(sock->tx_buf, sock->remote_winsize);
-            if (mbuf_len(payload) > 0) {
-                ctrl_flags |= TCP_ACK | TCP_PSH;
-            }
+    sock->retransmit_at = sys_uptime() + sock->rto;
+}
+
+/// Updates the RTT estimation and the retransmission timeout with a new
+/// sample (RFC 6298).
+static void tcp_update_rto(struct tcp_socket *sock, msec_t rtt) {
+    if (!sock->has_srtt) {
+        sock->srtt = rtt;
+        sock->rttvar = rtt / 2;
+        sock->has_srtt = true;
+    } else {
+        msec_t delta = (sock->srtt > rtt) ? sock->srtt - rtt : rtt - sock->srtt;
+        sock->rttvar = (3 * sock->rttvar + delta) / 4;
+        sock->srtt = (7 * sock->srtt + rtt) / 8;
+    }
+
+    msec_t rto = sock->srtt + MAX(TCP_CLOCK_GRANULARITY, 4 * sock->rttvar);
+    sock->rto = MIN(MAX(rto, TCP_RTO_MIN), TCP_RTO_MAX);
+}
+
+/// Starts measuring the RTT with a new segment at `seqno` unless another one
+/// is being timed.
+static void tcp_start_rtt_timing(struct tcp_socket *sock, uint32_t seqno) {
+    if (sock->snd_una == sock->snd_max) {
+        // Nothing is in flight: the new segment starts at `snd_una`.
+        sock->ts_una = sys_uptime();
+    }
 
-            if (sock->last_seqno == sock->next_seqno) {
-                sock->num_retransmits++;
+    if (sock->rtt_timing || seq_lt(seqno, sock->snd_max)) {
+        // Already timing or it's a retransmission.
+        return;
+    }
+
+    sock->rtt_timing = true;
+    sock->rtt_seqno = seqno;
+    sock->rtt_sent_at = sys_uptime();
+}
+
+/// Collects SACK blocks (pairs of the left and right edges) from the
+/// out-of-order queue. The block which contains the most recently received
+/// segment comes first as RFC 2018 requires.
+static size_t tcp_sack_blocks(struct tcp_socket *sock,
+                              uint32_t blocks[][2], size_t max_blocks) {
+    // Merge contiguous segments into blocks.
+    uint32_t merged[TCP_OOO_SEGMENTS_MAX][2];
+    size_t num_merged = 0;
+    size_t recent = 0;
+    LIST_FOR_EACH (seg, &sock->ooo_segs, struct tcp_ooo_segment, next) {
+        uint32_t end = seg->seqno + mbuf_len(seg->data);
+        uint32_t *last = num_merged ? merged[num_merged - 1] : NULL;
+        if (last && !seq_lt(last[1], seg->seqno)) {
+            if (seq_lt(last[1], end)) {
+                last[1] = end;
             }
-            break;
-        case TCP_STATE_SYN_RECVED:
-            ctrl_flags |= TCP_SYN | TCP_ACK;
-            break;
-        default:
-            break;
+        } else {
+            merged[num_merged][0] = seg->seqno;
+            merged[num_merged][1] = end;
+            num_merged++;
+        }
+
+        if (seg->seqno == sock->ooo_recent) {
+            recent = num_merged - 1;
+        }
+    }
+
+    size_t num_blocks = 0;
+    for (size_t i = 0; i < num_merged && num_blocks < max_blocks; i++) {
+        size_t index = i ? (i <= recent ? i - 1 : i) : recent;
+        blocks[num_blocks][0] = merged[index][0];
+        blocks[num_blocks][1] = merged[index][1];
+        num_blocks++;
+    }
+
+    return num_blocks;
+}
+
+/// Builds TCP options into `options` and returns their length. The length
+/// is a multiple of 4. Options in SYN are sent only if the remote has sent
+/// them (we don't open connections actively).
+static size_t tcp_build_options(struct tcp_socket *sock, struct device *device,
+                                uint8_t ctrl_flags, uint8_t *options) {
+    size_t len = 0;
+    if (ctrl_flags & TCP_SYN) {
+        // Advertise our MSS.
+        uint16_t mss = tcp_device_mss(device);
+        options[len++] = TCP_OPT_MSS;
+        options[len++] = 4;
+        options[len++] = mss >> 8;
+        options[len++] = mss & 0xff;
+
+        if (sock->sack_permitted) {
+            options[len++] = TCP_OPT_NOP;
+            options[len++] = TCP_OPT_NOP;
+            options[len++] = TCP_OPT_SACK_PERMITTED;
+            options[len++] = 2;
+        }
+
+        if (sock->window_scaling) {
+            options[len++] = TCP_OPT_NOP;
+            options[len++] = TCP_OPT_WSCALE;
+            options[len++] = 3;
+            options[len++] = sock->rcv_wscale;
+        }
     }
 
-    if (flags & TCP_PEND_ACK) {
-        ctrl_flags |= TCP_ACK;
+    if (sock->timestamps) {
+        uint32_t ts_val = hton32(sys_uptime());
+        uint32_t ts_ecr = hton32(sock->ts_recent);
+        options[len++] = TCP_OPT_NOP;
+        options[len++] = TCP_OPT_NOP;
+        options[len++] = TCP_OPT_TIMESTAMPS;
+        options[len++] = 10;
+        memcpy(&options[len], &ts_val, sizeof(ts_val));
+        memcpy(&options[len + 4], &ts_ecr, sizeof(ts_ecr));
+        len += 8;
     }
 
-    if (flags & TCP_PEND_FIN) {
-        ctrl_flags |= TCP_FIN;
+    if (ctrl_flags & TCP_SYN) {
+        return len;
+    }
+
+    if (sock->sack_permitted && !list_is_empty(&sock->ooo_segs)) {
+        // Report the data received out of order.
+        uint32_t blocks[TCP_SACK_BLOCKS_MAX][2];
+        size_t max_blocks =
+            MIN(TCP_SACK_BLOCKS_MAX, (TCP_OPTIONS_MAX_LEN - len - 4) / 8);
+        size_t num_blocks = tcp_sack_blocks(sock, blocks, max_blocks);
+        options[len++] = TCP_OPT_NOP;
+        options[len++] = TCP_OPT_NOP;
+        options[len++] = TCP_OPT_SACK;
+        options[len++] = 2 + num_blocks * 8;
+        for (size_t i = 0; i < num_blocks; i++) {
+            uint32_t left = hton32(blocks[i][0]);
+            uint32_t right = hton32(blocks[i][1]);
+            memcpy(&options[len], &left, sizeof(left));
+            memcpy(&options[len + 4], &right, sizeof(right));
+            len += 8;
+        }
     }
 
-    if (!mbuf_len(payload) && !ctrl_flags) {
-        // Nothing to send.
+    return len;
+}
+
+/// Transmits a segment. `payload` can be NULL and is deleted by this function.
+static void tcp_send_segment(struct tcp_socket *sock, uint32_t seqno,
+                             uint8_t ctrl_flags, mbuf_t payload) {
+    // Look for the device to determine the source IP address to compute the
+    // pseudo header checksum.
+    struct device *device = device_lookup(&sock->remote.addr);
+    if (!device) {
+        // No route.
         mbuf_delete(payload);
         return;
     }
 
+    uint8_t options[TCP_OPTIONS_MAX_LEN];
+    size_t options_len = tcp_build_options(sock, device, ctrl_flags, options);
+
     // Construct a TCP packet.
     struct tcp_header header;
+    size_t header_len = sizeof(header) + options_len;
     header.src_port = hton16(sock->local.port);
     header.dst_port = hton16(sock->remote.port);
-    header.seqno = hton32(sock->next_seqno);
+    header.seqno = hton32(seqno);
     header.ackno = (ctrl_flags & TCP_ACK) ? hton32(sock->last_ack) : 0;
-    header.off_and_ns = 5 << 4;
+    header.off_and_ns = (header_len / 4) << 4;
     header.flags = ctrl_flags;
-    header.win_size = hton16(sock->local_winsize);
+    // The window in SYN is not scaled.
+    uint32_t winsize = (ctrl_flags & TCP_SYN)
+                           ? sock->local_winsize
+                           : sock->local_winsize >> sock->rcv_wscale;
+    header.win_size = hton16(MIN(winsize, 0xffff));
     header.checksum = 0;
     header.urgent = 0;
 
-    // Look for the device to determine the source IP address to compute the
-    // pseudo header checksum.
-    struct device *device = device_lookup(&sock->remote.addr);
-    if (!device) {
-        // No route.
-        mbuf_delete(payload);
-        return;
-    }
-
     // Compute checksum.
     checksum_t checksum;
     checksum_init(&checksum);
     checksum_update_mbuf(&checksum, payload);
     checksum_update(&checksum, &header, sizeof(header));
+    checksum_update(&checksum, options, options_len);
 
     // Compute pseudo header checksum.
     switch (sock->remote.addr.type) {
         case IP_TYPE_V4: {
-            size_t total_len = sizeof(header) + mbuf_len(payload);
+            size_t total_len = header_len + mbuf_len(payload);
             checksum_update_uint32(&checksum, hton32(sock->remote.addr.v4));
             checksum_update_uint32(&checksum, hton32(device->ipaddr.v4));
             checksum_update_uint16(&checksum, hton16(total_len));
@@ -243,39 +510,554 @@ void tcp_transmit(tcp_sock_t sock) {
     }
 
     header.checksum = checksum_finish(&checksum);
-    mbuf_t pkt = mbuf_new(&header, sizeof(header));
-    if (payload) {
-        mbuf_append(pkt, payload);
+    if (ctrl_flags & TCP_ACK) {
+        // The received data is acknowledged.
+        sock->unacked_len = 0;
+        sock->delayed_ack_at = 0;
+        sock->last_ack_sent = sock->last_ack;
     }
 
+    mbuf_t pkt = payload ? payload : mbuf_alloc();
+    uint8_t *p = mbuf_push(&pkt, header_len);
+    memcpy(p, &header, sizeof(header));
+    memcpy(p + sizeof(header), options, options_len);
+
     // Transmit the packet.
     switch (sock->remote.addr.type) {
         case IP_TYPE_V4:
             ipv4_transmit(sock->remote.addr.v4, IPV4_PROTO_TCP, pkt);
             break;
     }
+}
+
+/// Sends a control segment (SYN or FIN) which consumes a sequence number
+/// unless it's already in flight.
+static bool tcp_send_ctrl(struct tcp_socket *sock, uint8_t ctrl_flags) {
+    if (sock->snd_nxt != sock->snd_una) {
+        return false;
+    }
+
+    tcp_start_rtt_timing(sock, sock->snd_nxt);
+    tcp_send_segment(sock, sock->snd_nxt, ctrl_flags | TCP_ACK, NULL);
+    sock->snd_nxt++;
+    if (seq_lt(sock->snd_max, sock->snd_nxt)) {
+        sock->snd_max = sock->snd_nxt;
+    }
+
+    tcp_start_rxt_timer(sock);
+    return true;
+}
+
+/// Returns the maximum payload length of a data segment: options are
+/// included in the MSS (RFC 6691). It's at least 1 byte.
+static size_t tcp_max_payload(struct tcp_socket *sock) {
+    uint8_t options[TCP_OPTIONS_MAX_LEN];
+    size_t options_len = tcp_build_options(sock, NULL, TCP_ACK, options);
+    return (sock->mss > options_len) ? sock->mss - options_len : 1;
+}
+
+/// Sends `len` bytes at `off` in the send buffer.
+static void tcp_send_data_segment(struct tcp_socket *sock, size_t off,
+                                  size_t len) {
+    uint8_t ctrl_flags = TCP_ACK;
+    if (off + len == mbuf_len(sock->tx_buf)) {
+        ctrl_flags |= TCP_PSH;
+    }
+
+    // Copy the data into a new cluster to prepend the headers in place.
+    mbuf_t payload = mbuf_copy(sock->tx_buf, off, len);
+    tcp_send_segment(sock, sock->snd_una + off, ctrl_flags, payload);
+}
+
+/// Sends data in the send window which has not yet been sent, split into
+/// MSS-sized segments. The window is the smaller one of the remote's window
+/// and the congestion window. If `probe` is true and the remote's window is
+/// closed, a byte is sent to probe when it reopens. Returns true if a
+/// segment has been sent.
+static bool tcp_send_data(struct tcp_socket *sock, bool probe) {
+    size_t buffered = mbuf_len(sock->tx_buf);
+    size_t window = MIN(sock->remote_winsize, sock->cwnd);
+    if (probe && !sock->remote_winsize) {
+        window = 1;
+    }
+
+    bool sent = false;
+    size_t max_payload = tcp_max_payload(sock);
+    while (true) {
+        size_t in_flight = sock->snd_nxt - sock->snd_una;
+        if (in_flight >= buffered || in_flight >= window) {
+            break;
+        }
+
+        size_t len = MIN(max_payload, MIN(buffered, window) - in_flight);
+        tcp_start_rtt_timing(sock, sock->snd_nxt);
+        tcp_send_data_segment(sock, in_flight, len);
+        sock->snd_nxt += len;
+        if (seq_lt(sock->snd_max, sock->snd_nxt)) {
+            sock->snd_max = sock->snd_nxt;
+        }
+
+        sent = true;
+    }
+
+    if (buffered > 0) {
+        // Wait for ACKs to the data in flight or for the window to open.
+        tcp_start_rxt_timer(sock);
+    }
+
+    return sent;
+}
+
+/// Retransmits the first unacknowledged segment.
+static void tcp_retransmit_first(struct tcp_socket *sock) {
+    size_t len = MIN(tcp_max_payload(sock), MIN(mbuf_len(sock->tx_buf),
+                                                sock->snd_max - sock->snd_una));
+    if (!len) {
+        return;
+    }
+
+    // Don't measure the RTT with an ACK which may be for the retransmission.
+    sock->rtt_timing = false;
+    tcp_send_data_segment(sock, 0, len);
+}
+
+/// Computes the integer cube root.
+static uint64_t cbrt64(uint64_t x) {
+    uint64_t y = 0;
+    for (int s = 63; s >= 0; s -= 3) {
+        y <<= 1;
+        uint64_t b = 3 * y * (y + 1) + 1;
+        if ((x >> s) >= b) {
+            x -= b << s;
+            y++;
+        }
+    }
+
+    return y;
+}
+
+/// Grows the congestion window in CUBIC's congestion avoidance.
+static void tcp_cubic_update(struct tcp_socket *sock, uint32_t acked) {
+    msec_t now = sys_uptime();
+    if (!sock->cubic_epoch_started) {
+        // A new congestion avoidance epoch.
+        sock->cubic_epoch_started = true;
+        sock->cubic_epoch = now;
+        sock->cubic_west = sock->cwnd;
+        if (sock->cwnd < sock->cubic_wmax) {
+            // K = cbrt((W_max - cwnd) / C) in seconds, where windows are
+            // counted in segments.
+            uint64_t diff = sock->cubic_wmax - sock->cwnd;
+            sock->cubic_k = cbrt64(diff * 10 * 1000 * 1000 * 1000
+                                   / (TCP_CUBIC_C * sock->mss));
+            sock->cubic_origin = sock->cubic_wmax;
+        } else {
+            sock->cubic_k = 0;
+            sock->cubic_origin = sock->cwnd;
+        }
+    }
+
+    // W_cubic(t + RTT) = C * (t + RTT - K)^3 + W_max. `t` is in milliseconds
+    // and bounded not to overflow.
+    int64_t t = (int64_t) (now - sock->cubic_epoch + sock->srtt)
+                - (int64_t) sock->cubic_k;
+    t = MIN(MAX(t, -1000000), 1000000);
+    int64_t cube = t * t * t / (1000 * 1000);
+    int64_t target =
+        sock->cubic_origin + cube * TCP_CUBIC_C * sock->mss / (10 * 1000);
+
+    // The window Reno would have: it grows by 3 * (1 - beta) / (1 + beta)
+    // segments per RTT.
+    sock->cubic_west += (uint64_t) acked * sock->mss * 3 * (10 - TCP_CUBIC_BETA)
+                        / ((10 + TCP_CUBIC_BETA) * sock->cwnd);
+    target = MAX(target, (int64_t) sock->cubic_west);
+    if (target > sock->cwnd) {
+        // Grow at most by half of the window per RTT.
+        target = MIN(target, (int64_t) sock->cwnd * 3 / 2);
+        sock->cwnd += MAX((target - sock->cwnd) * sock->mss / sock->cwnd, 1);
+    }
+}
+
+/// Grows the congestion window on an ACK to new data.
+static void tcp_cc_on_ack(struct tcp_socket *sock, uint32_t acked) {
+    if (sock->cwnd >= TCP_CWND_MAX) {
+        return;
+    }
+
+    if (sock->cwnd < sock->ssthresh) {
+        // Slow start.
+        sock->cwnd += MIN(acked, sock->mss);
+        return;
+    }
+
+    // Congestion avoidance.
+    switch (sock->cc) {
+        case TCP_CC_NEWRENO:
+            sock->cwnd += MAX(sock->mss * sock->mss / sock->cwnd, 1);
+            break;
+        case TCP_CC_CUBIC:
+            tcp_cubic_update(sock, acked);
+            break;
+    }
+}
+
+/// Returns the new slow start threshold on a loss.
+static uint32_t tcp_cc_on_loss(struct tcp_socket *sock) {
+    uint32_t in_flight = sock->snd_max - sock->snd_una;
+    switch (sock->cc) {
+        case TCP_CC_CUBIC:
+            // Remember where the loss happened. If it's below the previous
+            // one, release more bandwidth for other flows (fast convergence).
+            if (sock->cwnd < sock->cubic_wmax) {
+                sock->cubic_wmax =
+                    (uint64_t) sock->cwnd * (10 + TCP_CUBIC_BETA) / 20;
+            } else {
+                sock->cubic_wmax = sock->cwnd;
+            }
+
+            sock->cubic_epoch_started = false;
+            return MAX((uint64_t) sock->cwnd * TCP_CUBIC_BETA / 10,
+                       2 * sock->mss);
+        case TCP_CC_NEWRENO:
+        default:
+            return MAX(in_flight / 2, 2 * sock->mss);
+    }
+}
+
+/// Handles a duplicated ACK. The third one triggers a fast retransmit.
+static void tcp_cc_on_dup_ack(struct tcp_socket *sock) {
+    sock->dup_acks++;
+    if (sock->in_recovery) {
+        // A segment has left the network. Inflate the window.
+        sock->cwnd += sock->mss;
+        return;
+    }
+
+    // Don't enter fast recovery again for the losses of data sent before
+    // the last recovery or timeout (RFC 6582).
+    if (sock->dup_acks != TCP_DUP_ACK_THRESHOLD
+        || !seq_lt(sock->recover, sock->snd_una)) {
+        return;
+    }
+
+    sock->ssthresh = tcp_cc_on_loss(sock);
+    sock->cwnd = sock->ssthresh + TCP_DUP_ACK_THRESHOLD * sock->mss;
+    sock->recover = sock->snd_max;
+    sock->in_recovery = true;
+    tcp_retransmit_first(sock);
+}
+
+/// Handles an ACK to new data during fast recovery (NewReno).
+static void tcp_cc_on_recovery_ack(struct tcp_socket *sock, uint32_t acked) {
+    if (!seq_lt(sock->snd_una, sock->recover)) {
+        // A full ACK. Deflate the window and leave fast recovery.
+        uint32_t in_flight = sock->snd_max - sock->snd_una;
+        sock->cwnd = MIN(sock->ssthresh, MAX(in_flight, sock->mss) + sock->mss);
+        sock->in_recovery = false;
+        sock->dup_acks = 0;
+        return;
+    }
+
+    // A partial ACK: the next segment is also lost. Retransmit it and
+    // deflate the window by the amount of new data acked.
+    tcp_retransmit_first(sock);
+    sock->cwnd = (sock->cwnd > acked) ? sock->cwnd - acked : 0;
+    if (acked >= sock->mss) {
+        sock->cwnd += sock->mss;
+    }
+
+    sock->cwnd = MAX(sock->cwnd, sock->mss);
+}
 
-    // Update the retransmission timer.
-    sock->retransmit_at =
-        sys_uptime()
-        + MIN(TCP_RXT_MAX_TIMEOUT,
-              TCP_RXT_INITIAL_TIMEOUT << MIN(sock->num_retransmits, 8));
-    sock->last_seqno = sock->next_seqno;
+/// Shrinks the congestion window on a retransmission timeout.
+static void tcp_cc_on_timeout(struct tcp_socket *sock) {
+    sock->ssthresh = tcp_cc_on_loss(sock);
+    sock->cwnd = sock->mss;
+    sock->recover = sock->snd_max;
+    sock->in_recovery = false;
+    sock->dup_acks = 0;
+}
+
+void tcp_transmit(tcp_sock_t sock) {
+    uint32_t flags = tcp_clear_pendings(sock);
+    bool timed_out = sock->retransmit_at && sys_uptime() >= sock->retransmit_at;
+    if (timed_out) {
+        // Back off the timer. The RTO is kept until a new RTT sample.
+        sock->retransmit_at = 0;
+        sock->rto = MIN(sock->rto * 2, TCP_RTO_MAX);
+        if (sock->snd_una != sock->snd_max) {
+            // Retransmission timeout. Resend from the first unacknowledged
+            // byte. Otherwise, it's time to probe the zero window.
+            sock->rtt_timing = false;
+            tcp_cc_on_timeout(sock);
+            sock->snd_nxt = sock->snd_una;
+        }
+    }
+
+    bool sent = false;
+    switch (sock->state) {
+        case TCP_STATE_SYN_RECVED:
+            sent = tcp_send_ctrl(sock, TCP_SYN);
+            break;
+        case TCP_STATE_ESTABLISHED:
+        case TCP_STATE_CLOSE_WAIT:
+            sent = tcp_send_data(sock, timed_out);
+            break;
+        case TCP_STATE_LAST_ACK:
+            sent = tcp_send_ctrl(sock, TCP_FIN);
+            break;
+        default:
+            break;
+    }
+
+    if (sock->delayed_ack_at && sys_uptime() >= sock->delayed_ack_at) {
+        flags |= TCP_PEND_ACK;
+    }
+
+    // Every segment above carries an ACK.
+    if ((flags & TCP_PEND_ACK) && !sent) {
+        tcp_send_segment(sock, sock->snd_nxt, TCP_ACK, NULL);
+    }
+}
+
+/// Parses TCP options. Unknown options are ignored.
+static void tcp_parse_options(struct tcp_options *opts, const uint8_t *p,
+                              size_t len) {
+    opts->mss = 0;
+    opts->sack_permitted = false;
+    opts->has_wscale = false;
+    opts->has_timestamps = false;
+    size_t i = 0;
+    while (i < len && p[i] != TCP_OPT_END) {
+        if (p[i] == TCP_OPT_NOP) {
+            i++;
+            continue;
+        }
+
+        if (i + 1 >= len || p[i + 1] < 2 || i + p[i + 1] > len) {
+            // Malformed option.
+            break;
+        }
+
+        uint8_t kind = p[i];
+        uint8_t opt_len = p[i + 1];
+        switch (kind) {
+            case TCP_OPT_MSS:
+                if (opt_len == 4) {
+                    opts->mss = (p[i + 2] << 8) | p[i + 3];
+                }
+                break;
+            case TCP_OPT_SACK_PERMITTED:
+                opts->sack_permitted = true;
+                break;
+            case TCP_OPT_WSCALE:
+                if (opt_len == 3) {
+                    opts->has_wscale = true;
+                    opts->wscale = MIN(p[i + 2], TCP_WSCALE_MAX);
+                }
+                break;
+            case TCP_OPT_TIMESTAMPS:
+                if (opt_len == 10) {
+                    uint32_t ts_val, ts_ecr;
+                    memcpy(&ts_val, &p[i + 2], sizeof(ts_val));
+                    memcpy(&ts_ecr, &p[i + 6], sizeof(ts_ecr));
+                    opts->has_timestamps = true;
+                    opts->ts_val = ntoh32(ts_val);
+                    opts->ts_ecr = ntoh32(ts_ecr);
+                }
+                break;
+        }
+
+        i += opt_len;
+    }
+}
+
+/// Processes an ACK. Acknowledged data is removed from the send buffer.
+/// `dup_ack` is true if it's a duplicated ACK, which suggests a loss.
+static void tcp_process_ack(struct tcp_socket *sock, uint32_t ack,
+                            bool dup_ack, struct tcp_options *opts) {
+    if (dup_ack) {
+        tcp_cc_on_dup_ack(sock);
+        return;
+    }
+
+    if (!seq_lt(sock->snd_una, ack) || seq_lt(sock->snd_max, ack)) {
+        // An old ACK or an ACK to what we have not sent.
+        return;
+    }
+
+    // SYN and FIN are not in the buffer: they're not counted in `acked`.
+    size_t acked = mbuf_discard(&sock->tx_buf, ack - sock->snd_una);
+    sock->snd_una = ack;
+    if (seq_lt(sock->snd_nxt, ack)) {
+        // Segments sent before the retransmission timeout have arrived.
+        sock->snd_nxt = ack;
+    }
+
+    // The echoed timestamp tells the RTT of the segment being acked even if
+    // it's a retransmission (RFC 7323). Ignore one from the future or older
+    // than the first unacknowledged segment.
+    uint32_t now = sys_uptime();
+    if (sock->timestamps && opts->has_timestamps && opts->ts_ecr
+        && now - opts->ts_ecr <= now - sock->ts_una) {
+        tcp_update_rto(sock, now - opts->ts_ecr);
+        sock->rtt_timing = false;
+    } else if (sock->rtt_timing && seq_lt(sock->rtt_seqno, ack)) {
+        tcp_update_rto(sock, sys_uptime() - sock->rtt_sent_at);
+        sock->rtt_timing = false;
+    }
+
+    if (sock->in_recovery) {
+        tcp_cc_on_recovery_ack(sock, acked);
+    } else {
+        sock->dup_acks = 0;
+        tcp_cc_on_ack(sock, acked);
+    }
+
+    // Restart the retransmission timer for the rest in flight.
+    sock->retransmit_at = 0;
+    if (sock->snd_una != sock->snd_max) {
+        tcp_start_rxt_timer(sock);
+    }
+}
+
+/// Schedules an ACK to received data. It's delayed until data of two
+/// full-sized segments arrive or TCP_DELAYED_ACK_TIMEOUT passes (RFC 1122),
+/// unless an outgoing segment carries it earlier.
+static void tcp_delay_ack(struct tcp_socket *sock, size_t len) {
+    sock->unacked_len += len;
+    if (sock->unacked_len >= 2 * sock->mss) {
+        tcp_set_pendings(sock, TCP_PEND_ACK);
+        return;
+    }
+
+    if (!sock->delayed_ack_at) {
+        sock->delayed_ack_at = sys_uptime() + TCP_DELAYED_ACK_TIMEOUT;
+    }
+}
+
+/// Queues a segment received out of order. `payload` is consumed.
+static void tcp_queue_ooo(struct tcp_socket *sock, uint32_t seq,
+                          mbuf_t payload, bool fin) {
+    // Accept only what fits in the receive window.
+    uint32_t window_end = sock->last_ack + sock->local_winsize;
+    size_t len = mbuf_len(payload);
+    if (!len || !seq_lt(seq, window_end)
+        || list_len(&sock->ooo_segs) >= TCP_OOO_SEGMENTS_MAX) {
+        stats.tcp_dropped++;
+        mbuf_delete(payload);
+        return;
+    }
+
+    if (seq_lt(window_end, seq + len)) {
+        mbuf_truncate(payload, window_end - seq);
+        fin = false;
+    }
+
+    struct tcp_ooo_segment *new_seg = malloc(sizeof(*new_seg));
+    new_seg->seqno = seq;
+    new_seg->data = payload;
+    new_seg->fin = fin;
+    sock->ooo_recent = seq;
+
+    // Keep the queue sorted by the sequence number.
+    LIST_FOR_EACH (seg, &sock->ooo_segs, struct tcp_ooo_segment, next) {
+        if (seq_lt(seq, seg->seqno)) {
+            list_insert(seg->next.prev, &seg->next, &new_seg->next);
+            return;
+        }
+    }
+
+    list_push_back(&sock->ooo_segs, &new_seg->next);
+}
+
+/// Appends data at `last_ack` into the receive buffer. It must fit in the
+/// window.
+static void tcp_append_rx(struct tcp_socket *sock, mbuf_t data) {
+    size_t len = mbuf_len(data);
+    mbuf_append(sock->rx_buf, data);
+    sock->last_ack += len;
+    sock->local_winsize -= len;
+}
+
+/// Receives in-order data and moves out-of-order segments which have become
+/// contiguous into the receive buffer. `payload` is consumed.
+static void tcp_receive_data(struct tcp_socket *sock, mbuf_t payload,
+                             bool fin) {
+    size_t payload_len = mbuf_len(payload);
+    if (payload_len > sock->local_winsize) {
+        // The receive buffer is full. Accept what fits in the window and
+        // tell the remote the window immediately.
+        stats.tcp_dropped++;
+        tcp_set_pendings(sock, TCP_PEND_ACK);
+        mbuf_truncate(payload, sock->local_winsize);
+        payload_len = sock->local_winsize;
+        fin = false;
+    }
+
+    if (!payload_len) {
+        mbuf_delete(payload);
+    } else {
+        tcp_append_rx(sock, payload);
+    }
+
+    // Fill the gap with the queued segments.
+    struct tcp_ooo_segment *seg;
+    while (!fin
+           && (seg = LIST_POP_FRONT(&sock->ooo_segs, struct tcp_ooo_segment,
+                                    next))
+                  != NULL) {
+        if (seq_lt(sock->last_ack, seg->seqno)) {
+            // There's still a gap.
+            list_insert(&sock->ooo_segs, sock->ooo_segs.next, &seg->next);
+            break;
+        }
+
+        uint32_t end = seg->seqno + mbuf_len(seg->data);
+        if (seq_lt(sock->last_ack, end)) {
+            // Skip the part we have already received.
+            size_t len = end - sock->last_ack;
+            mbuf_discard(&seg->data, sock->last_ack - seg->seqno);
+            payload_len += len;
+            tcp_append_rx(sock, seg->data);
+            fin = seg->fin;
+        } else {
+            mbuf_delete(seg->data);
+        }
+
+        free(seg);
+    }
+
+    if (payload_len > 0) {
+        struct event e;
+        e.type = TCP_RECEIVED;
+        e.tcp_received.sock = sock;
+        sys_process_event(&e);
+    }
+
+    if (fin) {
+        // Passive close. Acknowlege to FIN. No data follows it.
+        sock->state = TCP_STATE_CLOSE_WAIT;
+        sock->last_ack++;
+        tcp_clear_ooo(sock);
+    }
 }
 
 static void tcp_process(struct tcp_socket *sock, ipaddr_t *src_addr,
                         port_t src_port, struct tcp_header *header,
-                        mbuf_t payload) {
+                        struct tcp_options *opts, mbuf_t payload) {
     uint32_t seq = ntoh32(header->seqno);
     uint32_t ack = ntoh32(header->ackno);
     uint8_t flags = header->flags;
+    size_t payload_len = mbuf_len(payload);
     TRACE("tcp: port=%d, seq=%08x, ack=%08x, len=%d [ %s%s%s]",
-          sock->local.port, seq, ack, mbuf_len(payload),
+          sock->local.port, seq, ack, payload_len,
           (flags & TCP_SYN) ? "SYN " : "", (flags & TCP_FIN) ? "FIN " : "",
           (flags & TCP_ACK) ? "ACK " : "");
 
     // Handle a SYN packet destinated to a LISTENing socket.
     if (sock->state == TCP_STATE_LISTEN) {
+        mbuf_delete(payload);
         if ((flags & TCP_SYN) == 0) {
             stats.tcp_discarded++;
             return;
@@ -291,33 +1073,109 @@ static void tcp_process(struct tcp_socket *sock, ipaddr_t *src_addr,
         struct tcp_socket *new_sock = tcp_new();
         new_sock->state = TCP_STATE_SYN_RECVED;
         new_sock->last_ack = seq + 1;
+        new_sock->remote_winsize = ntoh16(header->win_size);
+        new_sock->sack_permitted = opts->sack_permitted;
+        new_sock->cc = sock->cc;
+        new_sock->rx_autotune = sock->rx_autotune;
+        new_sock->tx_buf_size = sock->tx_buf_size;
+        if (opts->has_wscale) {
+            // Use the smallest shift count which can advertise the largest
+            // receive buffer.
+            uint32_t max_size = sock->rx_autotune
+                                    ? MAX(sock->rx_buf_size, TCP_RX_BUF_MAX)
+                                    : sock->rx_buf_size;
+            new_sock->window_scaling = true;
+            new_sock->snd_wscale = opts->wscale;
+            while (new_sock->rcv_wscale < TCP_WSCALE_MAX
+                   && (max_size >> new_sock->rcv_wscale) > 0xffff) {
+                new_sock->rcv_wscale++;
+            }
+        }
+
+        tcp_resize_rx_buf(new_sock,
+                          MIN(sock->rx_buf_size, tcp_max_window(new_sock)));
+        if (opts->has_timestamps) {
+            new_sock->timestamps = true;
+            new_sock->ts_recent = opts->ts_val;
+        }
         new_sock->listen_sock = sock;
         memcpy(&new_sock->local, &sock->local, sizeof(new_sock->local));
         memcpy(&new_sock->remote.addr, src_addr, sizeof(new_sock->remote.addr));
         new_sock->remote.port = src_port;
+
+        // Use the smaller one of the MSS of the remote and ours.
+        if (opts->mss) {
+            new_sock->mss = MAX(opts->mss, TCP_MIN_MSS);
+        }
+
+        struct device *device = device_lookup(src_addr);
+        if (device) {
+            new_sock->mss = MIN(new_sock->mss, tcp_device_mss(device));
+        }
+
+        new_sock->cwnd = tcp_initial_cwnd(new_sock->mss);
+
         list_push_back(&sock->backlog_socks, &new_sock->backlog_next);
         list_push_back(&active_socks, &new_sock->next);
         tcp_set_pendings(new_sock, TCP_PEND_ACK);
         return;
     }
 
+    if (sock->timestamps && opts->has_timestamps) {
+        if (seq_lt(opts->ts_val, sock->ts_recent)) {
+            // An old duplicated segment (PAWS in RFC 7323).
+            stats.tcp_discarded++;
+            tcp_set_pendings(sock, TCP_PEND_ACK);
+            mbuf_delete(payload);
+            return;
+        }
+
+        if (!seq_lt(sock->last_ack_sent, seq)) {
+            // Echo the timestamp of the earliest segment which is not
+            // acknowledged yet.
+            sock->ts_recent = opts->ts_val;
+        }
+    }
+
+    if (seq_lt(seq, sock->last_ack)
+        && seq_lt(sock->last_ack, seq + payload_len)) {
+        // A retransmitted segment which partially contains new data. Skip
+        // the part we have already received.
+        mbuf_discard(&payload, sock->last_ack - seq);
+        payload_len -= sock->last_ack - seq;
+        seq = sock->last_ack;
+    }
+
     if (seq != sock->last_ack) {
-        // Unexpected sequence number.
-        stats.tcp_discarded++;
+        // A segment after a lost one or a duplicated one. Tell the remote
+        // what we expect (with SACK blocks).
+        tcp_set_pendings(sock, TCP_PEND_ACK);
+        if (sock->state == TCP_STATE_ESTABLISHED
+            && seq_lt(sock->last_ack, seq)) {
+            tcp_queue_ooo(sock, seq, payload, flags & TCP_FIN);
+        } else {
+            stats.tcp_discarded++;
+            mbuf_delete(payload);
+        }
         return;
     }
 
-    sock->remote_winsize = ntoh32(header->win_size);
-
-    uint32_t acked_len = ack - sock->next_seqno;
-    if (acked_len > 0) {
-        mbuf_discard(&sock->tx_buf, acked_len);
-        sock->next_seqno += acked_len;
+    // A duplicated ACK (RFC 5681) acknowledges nothing new while data is
+    // outstanding, carries no data, and does not update the window.
+    uint32_t winsize = ntoh16(header->win_size) << sock->snd_wscale;
+    bool dup_ack = (flags & TCP_ACK) && !(flags & (TCP_SYN | TCP_FIN))
+                   && !payload_len && ack == sock->snd_una
+                   && sock->snd_una != sock->snd_max
+                   && winsize == sock->remote_winsize;
+    sock->remote_winsize = winsize;
+    if (flags & TCP_ACK) {
+        tcp_process_ack(sock, ack, dup_ack, opts);
     }
 
     switch (sock->state) {
         case TCP_STATE_SYN_RECVED: {
-            if ((flags & TCP_ACK) == 0) {
+            mbuf_delete(payload);
+            if ((flags & TCP_ACK) == 0 || sock->snd_una != sock->snd_max) {
                 // Invalid (unexpected) packet, ignoring...
                 stats.tcp_discarded++;
                 break;
@@ -325,10 +1183,7 @@ static void tcp_process(struct tcp_socket *sock, ipaddr_t *src_addr,
 
             // Received an ACK to the our SYN + ACK. The connection is now
             // ESTABLISHED.
-            sock->next_seqno = ack;
-            sock->last_ack = seq;
             sock->state = TCP_STATE_ESTABLISHED;
-            sock->retransmit_at = 0;
 
             struct event e;
             e.type = TCP_NEW_CLIENT;
@@ -337,36 +1192,20 @@ static void tcp_process(struct tcp_socket *sock, ipaddr_t *src_addr,
             break;
         }
         case TCP_STATE_ESTABLISHED:
-            if (flags & TCP_FIN) {
-                // Passive close. Acknowlege to FIN.
-                sock->state = TCP_STATE_CLOSE_WAIT;
-                sock->retransmit_at = 0;
-                sock->last_ack++;
-            }
-
             // Received data. Copy into the receive buffer.
-            TRACE("tcp: received %d bytes (seq=%x)", mbuf_len(payload), seq);
-            tcp_set_pendings(sock, TCP_PEND_ACK);
-            size_t payload_len = mbuf_len(payload);
-            if (payload_len > 0) {
-                if (sock->local_winsize < payload_len) {
-                    // The receive buffer is full.
-                    stats.tcp_dropped++;
-                    break;
-                }
-
-                mbuf_append(sock->rx_buf, payload);
-                sock->last_ack += mbuf_len(payload);
-                sock->local_winsize -= payload_len;
-
-                struct event e;
-                e.type = TCP_RECEIVED;
-                e.tcp_received.sock = sock;
-                sys_process_event(&e);
+            TRACE("tcp: received %d bytes (seq=%x)", payload_len, seq);
+            if ((flags & TCP_FIN) || !list_is_empty(&sock->ooo_segs)) {
+                // Acknowledge FIN and data filling a gap immediately.
+                tcp_set_pendings(sock, TCP_PEND_ACK);
+            } else if (payload_len > 0) {
+                tcp_delay_ack(sock, payload_len);
             }
+
+            tcp_receive_data(sock, payload, flags & TCP_FIN);
             break;
         case TCP_STATE_LAST_ACK:
-            if ((flags & TCP_ACK) == 0) {
+            mbuf_delete(payload);
+            if ((flags & TCP_ACK) == 0 || sock->snd_una != sock->snd_max) {
                 // Invalid (unexpected) packet, ignoring...
                 stats.tcp_discarded++;
                 break;
@@ -377,12 +1216,13 @@ static void tcp_process(struct tcp_socket *sock, ipaddr_t *src_addr,
             sock->state = TCP_STATE_CLOSED;
             break;
         default:
+            mbuf_delete(payload);
             break;
     }
 
     if (sock->state == TCP_STATE_CLOSE_WAIT && !mbuf_len(sock->tx_buf)) {
-        // No pending TX data. Finish the connection.
-        tcp_set_pendings(sock, TCP_PEND_FIN);
+        // No pending TX data. Finish the connection: FIN is sent in
+        // tcp_transmit.
         sock->state = TCP_STATE_LAST_ACK;
     }
 }
@@ -390,14 +1230,22 @@ static void tcp_process(struct tcp_socket *sock, ipaddr_t *src_addr,
 void tcp_receive(ipaddr_t *dst, ipaddr_t *src, mbuf_t pkt) {
     struct tcp_header header;
     if (mbuf_read(&pkt, &header, sizeof(header)) != sizeof(header)) {
+        mbuf_delete(pkt);
         return;
     }
 
     size_t offset = (header.off_and_ns >> 4) * 4;
-    if (offset > sizeof(header)) {
-        mbuf_discard(&pkt, offset - sizeof(header));
+    uint8_t options[TCP_OPTIONS_MAX_LEN];
+    size_t options_len = offset - sizeof(header);
+    if (offset < sizeof(header)
+        || mbuf_read(&pkt, options, options_len) != options_len) {
+        mbuf_delete(pkt);
+        return;
     }
 
+    struct tcp_options opts;
+    tcp_parse_options(&opts, options, options_len);
+
     uint16_t dst_port = ntoh16(header.dst_port);
     uint16_t src_port = ntoh16(header.src_port);
 
@@ -410,10 +1258,11 @@ void tcp_receive(ipaddr_t *dst, ipaddr_t *src, mbuf_t pkt) {
 
     struct tcp_socket *sock = tcp_lookup(&dst_ep, &src_ep);
     if (!sock) {
+        mbuf_delete(pkt);
         return;
     }
 
-    tcp_process(sock, src, src_port, &header, pkt);
+    tcp_process(sock, src, src_port, &header, &opts, pkt);
 }
 
 void tcp_flush(void) {
@@ -21,34 +21,157 @@ enum tcp_state {
 
 enum tcp_pending_flag {
     TCP_PEND_ACK = 1 << 0,
-    TCP_PEND_FIN = 1 << 1,
+};
+
+/// Congestion control algorithms.
+enum tcp_cc {
+    /// RFC 5681 and RFC 6582.
+    TCP_CC_NEWRENO,
+    /// RFC 9438.
+    TCP_CC_CUBIC,
 };
 
 struct client;
 
-#define TCP_SOCKETS_MAX         512
-#define TCP_RXT_INITIAL_TIMEOUT 500
-#define TCP_RXT_MAX_TIMEOUT     5000
-#define TCP_RX_BUF_SIZE         8192
+#define TCP_SOCKETS_MAX 512
+/// The default size of the receive buffer. It grows up to TCP_RX_BUF_MAX by
+/// autotuning unless its size is set explicitly.
+#define TCP_RX_BUF_SIZE  16384
+#define TCP_RX_BUF_MAX   (4 * 1024 * 1024)
+#define TCP_BUF_SIZE_MIN 4096
+#define TCP_BUF_SIZE_MAX (16 * 1024 * 1024)
+/// The maximum window scale shift (RFC 7323).
+#define TCP_WSCALE_MAX 14
+/// The retransmission timeout (RTO) in milliseconds (RFC 6298). The minimum
+/// is shorter than what the RFC recommends (1 second) like other
+/// implementations.
+#define TCP_RTO_INITIAL 1000
+#define TCP_RTO_MIN     200
+#define TCP_RTO_MAX     60000
+/// The resolution of sys_uptime() (TIMER_INTERVAL).
+#define TCP_CLOCK_GRANULARITY 200
+/// How long an ACK to received data can be delayed in milliseconds. It's
+/// sent at the timer tick after that.
+#define TCP_DELAYED_ACK_TIMEOUT 100
+/// The number of duplicated ACKs which triggers a fast retransmit.
+#define TCP_DUP_ACK_THRESHOLD 3
+#define TCP_CWND_MAX          (1 << 30)
+#define TCP_CC_DEFAULT        TCP_CC_CUBIC
+/// CUBIC parameters: the multiplicative decrease factor (beta_cubic) and the
+/// scaling constant (C) in tenths.
+#define TCP_CUBIC_BETA 7
+#define TCP_CUBIC_C    4
+/// The MSS assumed if the remote does not send the MSS option (RFC 1122).
+#define TCP_DEFAULT_MSS 536
+/// The smallest MSS accepted from the remote. A tiny MSS would leave no room
+/// for the payload after the options.
+#define TCP_MIN_MSS 88
+#define TCP_OPTIONS_MAX_LEN 40
+/// The maximum number of out-of-order segments queued in a socket.
+#define TCP_OOO_SEGMENTS_MAX 16
+/// The maximum number of SACK blocks in a segment (limited by the option
+/// space).
+#define TCP_SACK_BLOCKS_MAX 4
+
+/// A segment received out of order. It's kept until the gap in front of it
+/// is filled.
+struct tcp_ooo_segment {
+    list_elem_t next;
+    uint32_t seqno;
+    mbuf_t data;
+    bool fin;
+};
+
 struct tcp_socket {
     bool in_use;
     enum tcp_state state;
     uint32_t pendings;
-    /// The first byte of unacknwoledged by the remote.
-    uint32_t next_seqno;
-    /// The seqno which we have sent.
-    uint32_t last_seqno;
+    /// The first byte unacknowledged by the remote (SND.UNA).
+    uint32_t snd_una;
+    /// The next byte to be sent (SND.NXT). It goes back to `snd_una` on a
+    /// retransmission timeout.
+    uint32_t snd_nxt;
+    /// The highest byte ever sent plus one. ACKs up to it are acceptable.
+    uint32_t snd_max;
     /// The last byte received from the remote.
     uint32_t last_ack;
     uint32_t local_winsize;
     uint32_t remote_winsize;
+    /// The size of the receive buffer, and whether it's adjusted
+    /// automatically. Autotuning counts the bytes read by the application
+    /// since `autotune_at`.
+    uint32_t rx_buf_size;
+    bool rx_autotune;
+    uint32_t autotune_read_len;
+    msec_t autotune_at;
+    /// The size of the send buffer or 0 if it's unlimited. It's limited only
+    /// if the size is set explicitly.
+    uint32_t tx_buf_size;
+    /// Whether the window scale option is negotiated, and the shift counts
+    /// for windows we receive (`snd_wscale`) and send (`rcv_wscale`).
+    bool window_scaling;
+    uint8_t snd_wscale;
+    uint8_t rcv_wscale;
+    /// Whether the timestamps option is negotiated (RFC 7323), the
+    /// timestamp to be echoed, and the last ACK number we have sent.
+    bool timestamps;
+    uint32_t ts_recent;
+    uint32_t last_ack_sent;
+    /// The length of received data which we have not yet acknowledged, and
+    /// when to send the delayed ACK to it (0 if no ACK is delayed).
+    uint32_t unacked_len;
+    msec_t delayed_ack_at;
+    /// The maximum segment size: the smaller one of the remote's MSS option
+    /// and what the MTU of the device allows.
+    uint16_t mss;
+    /// Whether the remote accepts SACK options (RFC 2018).
+    bool sack_permitted;
     endpoint_t local;
     endpoint_t remote;
     mbuf_t rx_buf;
     mbuf_t tx_buf;
+    /// Segments received out of order (`struct tcp_ooo_segment`), sorted by
+    /// the sequence number.
+    list_t ooo_segs;
+    /// The sequence number of the last segment queued into `ooo_segs`. Its
+    /// SACK block is reported first.
+    uint32_t ooo_recent;
     size_t backlog;
-    unsigned num_retransmits;
+    /// When the retransmission timer expires (0 if it's not running).
     msec_t retransmit_at;
+    /// The smoothed RTT, its variation, and the retransmission timeout.
+    msec_t srtt;
+    msec_t rttvar;
+    msec_t rto;
+    /// Whether `srtt` has been measured.
+    bool has_srtt;
+    /// Whether a segment is being timed to measure the RTT: it's sent at
+    /// `rtt_sent_at` and starts at `rtt_seqno`. Retransmitted segments are not
+    /// timed (Karn's algorithm).
+    bool rtt_timing;
+    uint32_t rtt_seqno;
+    msec_t rtt_sent_at;
+    /// The timestamp of when the segment at `snd_una` was sent. Echoed
+    /// timestamps older than it are bogus.
+    uint32_t ts_una;
+    /// The congestion control algorithm and its state.
+    enum tcp_cc cc;
+    uint32_t cwnd;
+    uint32_t ssthresh;
+    unsigned dup_acks;
+    /// Whether we're in fast recovery, which ends when `recover` is acked.
+    bool in_recovery;
+    uint32_t recover;
+    /// CUBIC: the window before the last reduction, the window the cubic
+    /// function grows from, the time to reach `cubic_wmax` (K), and the
+    /// Reno-friendly window estimate. A congestion avoidance epoch starts at
+    /// `cubic_epoch` if `cubic_epoch_started` is true.
+    uint32_t cubic_wmax;
+    uint32_t cubic_origin;
+    msec_t cubic_k;
+    uint32_t cubic_west;
+    bool cubic_epoch_started;
+    msec_t cubic_epoch;
     struct tcp_socket *listen_sock;
     list_t backlog_socks;
     list_elem_t next;
@@ -66,6 +189,31 @@ enum tcp_header_flag {
     TCP_ACK = 1 << 4,
 };
 
+enum tcp_option_kind {
+    TCP_OPT_END = 0,
+    TCP_OPT_NOP = 1,
+    TCP_OPT_MSS = 2,
+    TCP_OPT_WSCALE = 3,
+    TCP_OPT_SACK_PERMITTED = 4,
+    TCP_OPT_SACK = 5,
+    TCP_OPT_TIMESTAMPS = 8,
+};
+
+/// Options in a received segment.
+struct tcp_options {
+    /// The MSS option or 0 if it's not present.
+    uint16_t mss;
+    /// Whether the SACK-permitted option is present.
+    bool sack_permitted;
+    /// The window scale option.
+    bool has_wscale;
+    uint8_t wscale;
+    /// The timestamps option.
+    bool has_timestamps;
+    uint32_t ts_val;
+    uint32_t ts_ecr;
+};
+
 struct tcp_header {
     uint16_t src_port;
     uint16_t dst_port;
@@ -82,8 +230,11 @@ tcp_sock_t tcp_new(void);
 void tcp_close(tcp_sock_t sock);
 void tcp_bind(tcp_sock_t sock, ipaddr_t *addr, port_t port);
 void tcp_listen(tcp_sock_t sock, int backlog);
+void tcp_set_cc(tcp_sock_t sock, enum tcp_cc cc);
 tcp_sock_t tcp_accept(tcp_sock_t sock);
-void tcp_write(tcp_sock_t sock, const void *data, size_t len);
+error_t tcp_set_rx_buf_size(tcp_sock_t sock, size_t size);
+error_t tcp_set_tx_buf_size(tcp_sock_t sock, size_t size);
+error_t tcp_write(tcp_sock_t sock, const void *data, size_t len);
 size_t tcp_read(tcp_sock_t sock, void *buf, size_t buf_len);
 void tcp_transmit(tcp_sock_t sock);
 void tcp_receive(ipaddr_t *dst, ipaddr_t *src, mbuf_t pkt);
@@ -130,14 +130,16 @@ void udp_transmit(udp_sock_t sock) {
     header.src_port = hton16(sock->local.port);
     header.checksum = 0;
     header.len = hton16(sizeof(header) + mbuf_len(dg->payload));
-    mbuf_t pkt = mbuf_new(&header, sizeof(header));
-    mbuf_prepend(dg->payload, pkt);
+    mbuf_t pkt = dg->payload;
+    memcpy(mbuf_push(&pkt, sizeof(header)), &header, sizeof(header));
 
     switch (dg->addr.type) {
         case IP_TYPE_V4:
             ipv4_transmit(dg->addr.v4, IPV4_PROTO_UDP, pkt);
             break;
     }
+
+    free(dg);
 }
 
 void udp_init(void) {
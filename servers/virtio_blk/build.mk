@@ -0,0 +1,2 @@
+name := virtio_blk
+objs := main.o virtio_blk.o
@@ -0,0 +1,326 @@
+#include <message.h>
+#include <std/io.h>
+#include <std/malloc.h>
+#include <std/pci.h>
+#include <std/printf.h>
+#include <std/syscall.h>
+#include <blk_queue.h>
+#include <cstring.h>
+#include <list.h>
+#include "virtio_blk.h"
+
+/// The maximum number of sectors in a BLK_READ_MSG or BLK_WRITE_MSG (limited by
+/// the size of the bulk buffer).
+#define BLK_MSG_MAX_SECTORS (8192 / SECTOR_SIZE)
+#define QUEUES_MAX 4
+
+/// An asynchronous I/O queue attached by a client.
+struct queue {
+    task_t client;
+    struct blk_queue *ring;
+    uint8_t *data;
+    size_t data_len;
+    /// The number of requests from the queue in the virtqueue. Completion
+    /// entries are reserved for them.
+    size_t num_inflight;
+};
+
+/// A BLK_READ_MSG or BLK_WRITE_MSG waiting for a free request.
+struct waiter {
+    list_elem_t next;
+    task_t client;
+    offset_t sector;
+    size_t num_sectors;
+    /// The data to be written or NULL if it's a read request.
+    void *data;
+};
+
+/// Where an in-flight request came from. Indexed by the request ID.
+struct pending {
+    /// The task waiting for the reply, or 0 if it's from a queue.
+    task_t client;
+    bool write;
+    size_t len;
+    struct queue *queue;
+    struct blk_request req;
+};
+
+static struct queue queues[QUEUES_MAX];
+static struct pending pendings[NUM_REQS];
+static list_t waiters;
+
+static bool is_valid_range(offset_t sector, size_t num_sectors) {
+    return num_sectors > 0 && sector + num_sectors > sector
+           && sector + num_sectors <= virtio_blk_capacity();
+}
+
+/// Submits a request from BLK_READ_MSG or BLK_WRITE_MSG. Returns false if the
+/// virtqueue is full.
+static bool submit(task_t client, offset_t sector, size_t num_sectors,
+                   void *data) {
+    int id = data ? virtio_blk_write(sector, data, num_sectors)
+                  : virtio_blk_read(sector, num_sectors);
+    if (id < 0) {
+        return false;
+    }
+
+    pendings[id].client = client;
+    pendings[id].write = data != NULL;
+    pendings[id].len = num_sectors * SECTOR_SIZE;
+    pendings[id].queue = NULL;
+    if (data) {
+        // The data has been copied into the request.
+        free(data);
+    }
+
+    return true;
+}
+
+static void complete(struct queue *queue, uint32_t tag, error_t status) {
+    struct blk_queue *ring = queue->ring;
+    struct blk_completion *c = &ring->cq[ring->cq_tail % BLK_QUEUE_DEPTH];
+    c->tag = tag;
+    c->status = status;
+    memory_barrier();
+    ring->cq_tail++;
+    ipc_notify(queue->client, NOTIFY_NEW_DATA);
+}
+
+static error_t validate_request(struct queue *queue, struct blk_request *req,
+                                size_t *len) {
+    if (req->op != BLK_OP_READ || req->num_sg > BLK_SG_MAX) {
+        return ERR_INVALID_ARG;
+    }
+
+    size_t total = 0;
+    for (int i = 0; i < req->num_sg; i++) {
+        struct blk_sg *sg = &req->sg[i];
+        if (sg->len % SECTOR_SIZE != 0
+            || (size_t) sg->offset + sg->len > queue->data_len) {
+            return ERR_INVALID_ARG;
+        }
+
+        total += sg->len;
+    }
+
+    if (total > REQ_BUF_SIZE
+        || !is_valid_range(req->sector, total / SECTOR_SIZE)) {
+        return ERR_INVALID_ARG;
+    }
+
+    *len = total;
+    return OK;
+}
+
+/// Moves submitted requests into the virtqueue. Requests which don't fit
+/// are left in the ring and retried when a request completes.
+static void process_queue(struct queue *queue) {
+    struct blk_queue *ring = queue->ring;
+    while (ring->sq_head != ring->sq_tail
+           && ring->cq_tail - ring->cq_head + queue->num_inflight
+                  < BLK_QUEUE_DEPTH) {
+        memory_barrier();
+        // Copy the request not to be affected by the client's modifications.
+        struct blk_request req = ring->sq[ring->sq_head % BLK_QUEUE_DEPTH];
+        size_t len;
+        error_t err = validate_request(queue, &req, &len);
+        if (IS_ERROR(err)) {
+            ring->sq_head++;
+            complete(queue, req.tag, err);
+            continue;
+        }
+
+        int id = virtio_blk_read(req.sector, len / SECTOR_SIZE);
+        if (id < 0) {
+            break;
+        }
+
+        ring->sq_head++;
+        queue->num_inflight++;
+        pendings[id].client = 0;
+        pendings[id].write = false;
+        pendings[id].len = len;
+        pendings[id].queue = queue;
+        pendings[id].req = req;
+    }
+}
+
+static void done(int id, error_t status) {
+    struct pending *pending = &pendings[id];
+    uint8_t *buf = virtio_blk_buffer(id);
+    if (!pending->queue) {
+        if (IS_ERROR(status)) {
+            ipc_reply_err(pending->client, status);
+            return;
+        }
+
+        struct message m;
+        if (pending->write) {
+            m.type = BLK_WRITE_REPLY_MSG;
+        } else {
+            m.type = BLK_READ_REPLY_MSG;
+            m.blk_read_reply.data = buf;
+            m.blk_read_reply.len = pending->len;
+        }
+
+        ipc_reply(pending->client, &m);
+        return;
+    }
+
+    struct queue *queue = pending->queue;
+    if (IS_OK(status)) {
+        for (int i = 0; i < pending->req.num_sg; i++) {
+            struct blk_sg *sg = &pending->req.sg[i];
+            memcpy(&queue->data[sg->offset], buf, sg->len);
+            buf += sg->len;
+        }
+    }
+
+    queue->num_inflight--;
+    complete(queue, pending->req.tag, status);
+}
+
+/// Submits the requests which were waiting for free requests.
+static void retry_pending_requests(void) {
+    struct waiter *waiter;
+    while ((waiter = LIST_POP_FRONT(&waiters, struct waiter, next)) != NULL) {
+        if (!submit(waiter->client, waiter->sector, waiter->num_sectors,
+                    waiter->data)) {
+            // Still full. Put it back to the front.
+            list_insert(&waiters, waiters.next, &waiter->next);
+            return;
+        }
+
+        free(waiter);
+    }
+
+    for (int i = 0; i < QUEUES_MAX; i++) {
+        if (queues[i].client) {
+            process_queue(&queues[i]);
+        }
+    }
+}
+
+static error_t attach_queue(task_t client, vaddr_t vaddr, size_t num_pages) {
+    if (num_pages < 2) {
+        return ERR_INVALID_ARG;
+    }
+
+    // We write into the pages: make sure they're granted by the client.
+    error_t err = io_verify_grant(client, vaddr, num_pages, true);
+    if (IS_ERROR(err)) {
+        return err;
+    }
+
+    for (int i = 0; i < QUEUES_MAX; i++) {
+        if (!queues[i].client) {
+            queues[i].client = client;
+            queues[i].ring = (struct blk_queue *) vaddr;
+            queues[i].data = (uint8_t *) vaddr + PAGE_SIZE;
+            queues[i].data_len = (num_pages - 1) * PAGE_SIZE;
+            queues[i].num_inflight = 0;
+            return OK;
+        }
+    }
+
+    return ERR_NO_MEMORY;
+}
+
+void main(void) {
+    error_t err;
+    INFO("starting...");
+    list_init(&waiters);
+
+    struct pci_device pcidev;
+    if (!pci_find_device(&pcidev, 0x1af4, 0x1001)) {
+        PANIC("failed to locate a virtio-blk device");
+    }
+
+    INFO("found a virtio-blk device (bus=%d, slot=%d, bar0=%x, irq=%d)",
+         pcidev.bus, pcidev.slot, pcidev.bar0, pcidev.irq);
+
+    // Initialize the device and listen for IRQ messages.
+    err = irq_acquire(pcidev.irq);
+    ASSERT_OK(err);
+    pci_enable_bus_master(&pcidev);
+    virtio_blk_init(&pcidev);
+    INFO("initialized the device (%lld MiB)",
+         virtio_blk_capacity() * SECTOR_SIZE / (1024 * 1024));
+
+    // The mainloop: receive and handle messages. Read requests are appended
+    // into the virtqueue as they arrive and the device is notified at the end
+    // of each iteration (see virtio_blk_flush) so that it can process requests
+    // in a batch.
+    INFO("ready");
+    while (true) {
+        struct message m;
+        err = ipc_recv(IPC_ANY, &m);
+        ASSERT_OK(err);
+
+        switch (m.type) {
+            case NOTIFICATIONS_MSG:
+                if (m.notifications.data & NOTIFY_IRQ) {
+                    virtio_blk_handle_interrupt(done);
+                    retry_pending_requests();
+                }
+
+                if (m.notifications.data & NOTIFY_NEW_DATA) {
+                    for (int i = 0; i < QUEUES_MAX; i++) {
+                        if (queues[i].client) {
+                            process_queue(&queues[i]);
+                        }
+                    }
+                }
+                break;
+            case BLK_ATTACH_QUEUE_MSG: {
+                err = attach_queue(m.src, m.blk_attach_queue.vaddr,
+                                   m.blk_attach_queue.num_pages);
+                if (IS_ERROR(err)) {
+                    ipc_reply_err(m.src, err);
+                    break;
+                }
+
+                m.type = BLK_ATTACH_QUEUE_REPLY_MSG;
+                ipc_reply(m.src, &m);
+                break;
+            }
+            case BLK_READ_MSG:
+            case BLK_WRITE_MSG: {
+                bool write = m.type == BLK_WRITE_MSG;
+                offset_t sector = write ? m.blk_write.sector : m.blk_read.sector;
+                size_t num_sectors = write ? m.blk_write.len / SECTOR_SIZE
+                                           : m.blk_read.num_sectors;
+                void *data = write ? m.blk_write.data : NULL;
+                if ((write && m.blk_write.len % SECTOR_SIZE != 0)
+                    || num_sectors > BLK_MSG_MAX_SECTORS
+                    || !is_valid_range(sector, num_sectors)) {
+                    ipc_reply_err(m.src, ERR_NOT_ACCEPTABLE);
+                    if (data) {
+                        free(data);
+                    }
+                    break;
+                }
+
+                // The reply is sent when the request completes.
+                if (!list_is_empty(&waiters)
+                    || !submit(m.src, sector, num_sectors, data)) {
+                    struct waiter *waiter = malloc(sizeof(*waiter));
+                    waiter->client = m.src;
+                    waiter->sector = sector;
+                    waiter->num_sectors = num_sectors;
+                    waiter->data = data;
+                    list_push_back(&waiters, &waiter->next);
+                }
+                break;
+            }
+            case BLK_MAP_MSG:
+                // The disk is not in memory.
+                ipc_reply_err(m.src, ERR_UNAVAILABLE);
+                break;
+            default:
+                TRACE("unknown message %d", m.type);
+        }
+
+        virtio_blk_flush();
+    }
+}
@@ -0,0 +1,221 @@
+#include <std/io.h>
+#include <std/pci.h>
+#include <std/printf.h>
+#include <cstring.h>
+#include "virtio_blk.h"
+
+static uint16_t port_base;
+static offset_t capacity;
+static uint16_t queue_size;
+static struct virtq_desc *descs;
+static struct virtq_avail *avail;
+static struct virtq_used *used;
+static uint16_t last_used_index;
+static struct virtio_blk_req_header *headers;
+static paddr_t headers_paddr;
+static uint8_t *statuses;
+static paddr_t statuses_paddr;
+static uint8_t *buffers;
+static paddr_t buffers_paddr;
+static bool in_use[NUM_REQS];
+/// The number of submitted requests which are not yet completed.
+static int num_inflight;
+/// The number of submitted requests which the device is not notified of yet.
+static int num_unkicked;
+
+static uint32_t read_reg32(uint16_t offset) {
+    return io_in32(port_base + offset);
+}
+
+static uint16_t read_reg16(uint16_t offset) {
+    return io_in16(port_base + offset);
+}
+
+static uint8_t read_reg8(uint16_t offset) {
+    return io_in8(port_base + offset);
+}
+
+static void write_reg32(uint16_t offset, uint32_t value) {
+    io_out32(port_base + offset, value);
+}
+
+static void write_reg16(uint16_t offset, uint16_t value) {
+    io_out16(port_base + offset, value);
+}
+
+static void write_reg8(uint16_t offset, uint8_t value) {
+    io_out8(port_base + offset, value);
+}
+
+void virtio_blk_init(struct pci_device *pcidev) {
+    // BAR0 is an I/O port space in the legacy interface.
+    ASSERT((pcidev->bar0 & 1) != 0);
+    port_base = pcidev->bar0 & ~0x3;
+
+    // Reset the device and tell it that we've found and know how to drive it.
+    write_reg8(VIRTIO_REG_DEVICE_STATUS, 0);
+    write_reg8(VIRTIO_REG_DEVICE_STATUS, VIRTIO_STATUS_ACK);
+    write_reg8(VIRTIO_REG_DEVICE_STATUS,
+               VIRTIO_STATUS_ACK | VIRTIO_STATUS_DRIVER);
+
+    // We don't need any optional features.
+    write_reg32(VIRTIO_REG_DRIVER_FEATS, 0);
+
+    // Set up the request queue (queue #0). In the legacy interface, the used
+    // ring starts at the next page boundary after the available ring.
+    write_reg16(VIRTIO_REG_QUEUE_SELECT, 0);
+    queue_size = read_reg16(VIRTIO_REG_QUEUE_SIZE);
+    if (queue_size < NUM_REQS * 3) {
+        write_reg8(VIRTIO_REG_DEVICE_STATUS, VIRTIO_STATUS_FAILED);
+        PANIC("the virtqueue is too small (size=%d)", queue_size);
+    }
+
+    size_t avail_end = sizeof(struct virtq_desc) * queue_size
+                       + sizeof(struct virtq_avail)
+                       + sizeof(uint16_t) * (queue_size + 1);
+    size_t used_off = ALIGN_UP(avail_end, PAGE_SIZE);
+    size_t used_len = sizeof(struct virtq_used)
+                      + sizeof(struct virtq_used_elem) * queue_size
+                      + sizeof(uint16_t);
+    size_t num_pages = (used_off + ALIGN_UP(used_len, PAGE_SIZE)) / PAGE_SIZE;
+    paddr_t vq_paddr;
+    uint8_t *vq = io_alloc_pages(num_pages, 0, &vq_paddr);
+    memset(vq, 0, num_pages * PAGE_SIZE);
+    descs = (struct virtq_desc *) vq;
+    avail = (struct virtq_avail *) &vq[sizeof(struct virtq_desc) * queue_size];
+    used = (struct virtq_used *) &vq[used_off];
+    write_reg32(VIRTIO_REG_QUEUE_ADDR_PFN, vq_paddr / PAGE_SIZE);
+
+    // Allocate request headers, status bytes, and data buffers.
+    STATIC_ASSERT(sizeof(struct virtio_blk_req_header) * NUM_REQS + NUM_REQS
+                  <= PAGE_SIZE);
+    headers = io_alloc_pages(1, 0, &headers_paddr);
+    statuses = (uint8_t *) &headers[NUM_REQS];
+    statuses_paddr = headers_paddr + sizeof(*headers) * NUM_REQS;
+    buffers = io_alloc_pages(NUM_REQS * REQ_BUF_SIZE / PAGE_SIZE, 0,
+                             &buffers_paddr);
+
+    // Each request uses a fixed chain of three descriptors: the header, the
+    // data buffer, and the status byte.
+    for (int id = 0; id < NUM_REQS; id++) {
+        struct virtq_desc *desc = &descs[id * 3];
+        desc[0].paddr = headers_paddr + sizeof(*headers) * id;
+        desc[0].len = sizeof(*headers);
+        desc[0].flags = VIRTQ_DESC_F_NEXT;
+        desc[0].next = id * 3 + 1;
+        desc[1].paddr = buffers_paddr + REQ_BUF_SIZE * id;
+        desc[1].next = id * 3 + 2;
+        desc[2].paddr = statuses_paddr + id;
+        desc[2].len = 1;
+        desc[2].flags = VIRTQ_DESC_F_WRITE;
+    }
+
+    capacity = read_reg32(VIRTIO_REG_BLK_CAPACITY)
+               | ((offset_t) read_reg32(VIRTIO_REG_BLK_CAPACITY + 4) << 32);
+    write_reg8(VIRTIO_REG_DEVICE_STATUS, VIRTIO_STATUS_ACK
+                                             | VIRTIO_STATUS_DRIVER
+                                             | VIRTIO_STATUS_DRIVER_OK);
+}
+
+/// Returns the number of sectors in the disk.
+offset_t virtio_blk_capacity(void) {
+    return capacity;
+}
+
+static int submit(uint32_t type, offset_t sector, const void *data,
+                  size_t num_sectors) {
+    ASSERT(num_sectors * SECTOR_SIZE <= REQ_BUF_SIZE);
+
+    int id;
+    for (id = 0; id < NUM_REQS; id++) {
+        if (!in_use[id]) {
+            break;
+        }
+    }
+
+    if (id == NUM_REQS) {
+        return ERR_WOULD_BLOCK;
+    }
+
+    in_use[id] = true;
+    headers[id].type = type;
+    headers[id].reserved = 0;
+    headers[id].sector = sector;
+    statuses[id] = 0xff;
+    struct virtq_desc *data_desc = &descs[id * 3 + 1];
+    data_desc->len = num_sectors * SECTOR_SIZE;
+    if (data) {
+        memcpy(virtio_blk_buffer(id), data, num_sectors * SECTOR_SIZE);
+        data_desc->flags = VIRTQ_DESC_F_NEXT;
+    } else {
+        data_desc->flags = VIRTQ_DESC_F_NEXT | VIRTQ_DESC_F_WRITE;
+    }
+
+    avail->ring[avail->index % queue_size] = id * 3;
+    memory_barrier();
+    avail->index++;
+    num_inflight++;
+    num_unkicked++;
+    return id;
+}
+
+/// Appends a read request into the virtqueue. The device is not notified
+/// until `virtio_blk_flush` is called. Returns the request ID or
+/// ERR_WOULD_BLOCK if all requests are in use.
+int virtio_blk_read(offset_t sector, size_t num_sectors) {
+    return submit(VIRTIO_BLK_T_IN, sector, NULL, num_sectors);
+}
+
+/// Appends a write request into the virtqueue. `data` is copied into the
+/// request's buffer.
+int virtio_blk_write(offset_t sector, const void *data, size_t num_sectors) {
+    return submit(VIRTIO_BLK_T_OUT, sector, data, num_sectors);
+}
+
+/// Returns the data buffer of the request.
+uint8_t *virtio_blk_buffer(int id) {
+    DEBUG_ASSERT(0 <= id && id < NUM_REQS);
+    return &buffers[REQ_BUF_SIZE * id];
+}
+
+/// Notifies the device of the requests appended since the last notification.
+void virtio_blk_flush(void) {
+    if (!num_unkicked) {
+        return;
+    }
+
+    // While earlier requests are in flight, we'll get an interrupt when one of
+    // them completes. Defer the notification until then to submit the
+    // requests arriving in the meantime by a single notification.
+    if (num_inflight > num_unkicked) {
+        return;
+    }
+
+    memory_barrier();
+    if ((used->flags & VIRTQ_USED_F_NO_NOTIFY) == 0) {
+        write_reg16(VIRTIO_REG_QUEUE_NOTIFY, 0);
+    }
+
+    num_unkicked = 0;
+}
+
+void virtio_blk_handle_interrupt(void (*done)(int id, error_t status)) {
+    // Acknowledge the interrupt.
+    read_reg8(VIRTIO_REG_ISR_STATUS);
+
+    while (last_used_index != used->index) {
+        memory_barrier();
+        struct virtq_used_elem *e = &used->ring[last_used_index % queue_size];
+        int id = e->id / 3;
+        ASSERT(id < NUM_REQS && in_use[id]);
+        last_used_index++;
+        num_inflight--;
+        if (num_unkicked > num_inflight) {
+            // The device has picked up requests before being notified.
+            num_unkicked = num_inflight;
+        }
+
+        done(id, (statuses[id] == VIRTIO_BLK_S_OK) ? OK : ERR_UNAVAILABLE);
+        in_use[id] = false;
+    }
+}
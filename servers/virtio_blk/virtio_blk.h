@@ -0,0 +1,81 @@
+#ifndef __VIRTIO_BLK_H__
+#define __VIRTIO_BLK_H__
+
+#include <types.h>
+
+//
+//  Legacy virtio PCI registers (offsets from the I/O port BAR0).
+//
+#define VIRTIO_REG_DEVICE_FEATS   0x00
+#define VIRTIO_REG_DRIVER_FEATS   0x04
+#define VIRTIO_REG_QUEUE_ADDR_PFN 0x08
+#define VIRTIO_REG_QUEUE_SIZE     0x0c
+#define VIRTIO_REG_QUEUE_SELECT   0x0e
+#define VIRTIO_REG_QUEUE_NOTIFY   0x10
+#define VIRTIO_REG_DEVICE_STATUS  0x12
+#define VIRTIO_REG_ISR_STATUS     0x13
+/// The number of sectors (64-bit) in the virtio-blk device configuration.
+#define VIRTIO_REG_BLK_CAPACITY 0x14
+
+#define VIRTIO_STATUS_ACK       1
+#define VIRTIO_STATUS_DRIVER    2
+#define VIRTIO_STATUS_DRIVER_OK 4
+#define VIRTIO_STATUS_FAILED    128
+
+/// The buffer continues via the `next` field.
+#define VIRTQ_DESC_F_NEXT 1
+/// The buffer is write-only for the device.
+#define VIRTQ_DESC_F_WRITE 2
+/// Set by the device: we don't have to notify it of new buffers.
+#define VIRTQ_USED_F_NO_NOTIFY 1
+
+struct virtq_desc {
+    uint64_t paddr;
+    uint32_t len;
+    uint16_t flags;
+    uint16_t next;
+} PACKED;
+
+struct virtq_avail {
+    uint16_t flags;
+    uint16_t index;
+    uint16_t ring[];
+} PACKED;
+
+struct virtq_used_elem {
+    uint32_t id;
+    uint32_t len;
+} PACKED;
+
+struct virtq_used {
+    uint16_t flags;
+    uint16_t index;
+    struct virtq_used_elem ring[];
+} PACKED;
+
+#define VIRTIO_BLK_T_IN  0
+#define VIRTIO_BLK_T_OUT 1
+#define VIRTIO_BLK_S_OK  0
+
+struct virtio_blk_req_header {
+    uint32_t type;
+    uint32_t reserved;
+    uint64_t sector;
+} PACKED;
+
+#define SECTOR_SIZE 512
+/// The number of requests which can be in flight at once.
+#define NUM_REQS 16
+/// The size of the data buffer of each request.
+#define REQ_BUF_SIZE (8 * PAGE_SIZE)
+
+struct pci_device;
+void virtio_blk_init(struct pci_device *pcidev);
+offset_t virtio_blk_capacity(void);
+int virtio_blk_read(offset_t sector, size_t num_sectors);
+int virtio_blk_write(offset_t sector, const void *data, size_t num_sectors);
+uint8_t *virtio_blk_buffer(int id);
+void virtio_blk_flush(void);
+void virtio_blk_handle_interrupt(void (*done)(int id, error_t status));
+
+#endif